@@ -0,0 +1,235 @@
+#include <time.h>
+#include "cjson.h"
+
+// Throughput benchmarks. Run with make bench.
+
+#define BENCH_RECORDS 200000
+#define BENCH_TOKENS 2000000
+
+static double now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool append_str(StringBuilder *sb, const char *str)
+{
+    for (; *str; str++)
+        if (!append_sb(sb, *str))
+            return false;
+    return true;
+}
+
+// A single top level array of records, the typical large document.
+static char *generate_records(unsigned int records)
+{
+    StringBuilder builder;
+    if (!initial_sb(&builder))
+        return NULL;
+
+    char buf[256];
+    if (!append_sb(&builder, '['))
+        goto failed;
+    for (unsigned int i = 0; records > i; i++) {
+        snprintf(buf, sizeof(buf),
+                 "%s\n  {\"id\": %u, \"name\": \"record \\\"%u\\\"\", \"score\": %u.%02u, "
+                 "\"active\": %s, \"tags\": [\"a\", \"b\", null], \"ratio\": -%ue-3}",
+                 i ? "," : "", i, i, i % 1000, i % 100, i % 2 ? "true" : "false", i % 977);
+        if (!append_str(&builder, buf))
+            goto failed;
+    }
+    if (!append_str(&builder, "\n]\n") || !get_str_sb(&builder))
+        goto failed;
+    return builder.str;
+
+failed:
+    free(builder.str);
+    return NULL;
+}
+
+static void bench_parse_parallel(const char *code, size_t length)
+{
+    double start = now();
+    JSONValue *value = parse(code);
+    double elapsed = now() - start;
+    printf("parse()                %8.1f MB/s\n", length / elapsed / 1e6);
+    free_json(value);
+
+    for (unsigned int threads = 2; 16 >= threads; threads *= 2) {
+        start = now();
+        value = parse_parallel(code, threads);
+        elapsed = now() - start;
+        printf("parse_parallel(%2u)     %8.1f MB/s%s\n", threads, length / elapsed / 1e6,
+               value ? "" : " (failed)");
+        free_json(value);
+    }
+}
+
+// The probe chain scan_token() used before the classification table, kept
+// as the baseline for bench_token_classes().
+#define IF_STRING_MATCH_THEN_RETURN_TOKEN(kind, str) \
+{ \
+    unsigned int len = strlen(str); \
+    if (end_char - current_char >= len && !strncmp(current_char, str, len)) { \
+        *kind_ptr = kind; \
+        return current_char + len; \
+    } \
+} \
+
+static const char *probe_scan_token(const char *current_char, const char *end_char, TokenKind *kind_ptr)
+{
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_FALSE, "false");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_TRUE, "true");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_NULL, "null");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_BEGIN_ARRAY, "[");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_END_ARRAY, "]");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_VALUE_SEP, ",");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_BEGIN_OBJECT, "{");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_NAME_SEP, ":");
+    IF_STRING_MATCH_THEN_RETURN_TOKEN(TK_END_OBJECT, "}");
+
+    if (*current_char == '-' || isdigit((unsigned char)*current_char)) {
+        *kind_ptr = TK_NUM;
+        return scan_number(current_char, end_char);
+    }
+    if (*current_char == '"') {
+        *kind_ptr = TK_STR;
+        return scan_string(current_char, end_char);
+    }
+    return NULL;
+}
+
+typedef const char *(*ScanFunc)(const char *current_char, const char *end_char, TokenKind *kind_ptr);
+
+// Returns tokens per second, or 0 if the text does not scan.
+static double scan_rate(ScanFunc scan, const char *code, size_t length)
+{
+    const char *current_char = code;
+    const char *end_char = code + length;
+    unsigned long tokens = 0;
+    double start = now();
+    while ((current_char = skip_whitespace(current_char, end_char)) < end_char) {
+        TokenKind kind;
+        if (!(current_char = scan(current_char, end_char, &kind)))
+            return 0;
+        tokens++;
+    }
+    return tokens / (now() - start);
+}
+
+// Token dispatch of the lexer by token class, against the probe chain.
+static void bench_token_classes(void)
+{
+    static const struct {
+        const char *name;
+        const char *tokens; // BENCH_TOKENS回繰り返す
+    } classes[] = {
+        { "literals", "true false null " },
+        { "structural", "[ ] , { } : " },
+        { "numbers", "-12.5e3 7 " },
+        { "strings", "\"name\" \"\" " },
+    };
+
+    printf("Token class       probe chain      table\n");
+    for (size_t i = 0; sizeof(classes) / sizeof(classes[0]) > i; i++) {
+        StringBuilder builder;
+        if (!initial_sb(&builder))
+            return;
+        bool ok = true;
+        for (unsigned int j = 0; ok && BENCH_TOKENS > j; j++)
+            ok = append_str(&builder, classes[i].tokens);
+        if (!ok || !get_str_sb(&builder)) {
+            free(builder.str);
+            return;
+        }
+
+        double probe = scan_rate(probe_scan_token, builder.str, builder.size);
+        double table = scan_rate(scan_token, builder.str, builder.size);
+        printf("%-12s %10.1f M/s %10.1f M/s  x%.2f\n", classes[i].name, probe / 1e6, table / 1e6,
+               probe ? table / probe : 0);
+        free(builder.str);
+    }
+}
+
+static bool count_output(void *user_data, const char *data, size_t size)
+{
+    *(size_t *)user_data += size;
+    return true;
+}
+
+// Rows of numbers, as exported from a database.
+static void bench_writer(void)
+{
+    size_t length = 0;
+    JSONWriter *writer = new_writer(count_output, &length);
+    if (!writer)
+        return;
+
+    double start = now();
+    write_begin_array(writer);
+    for (unsigned int i = 0; BENCH_RECORDS * 5 > i; i++) {
+        write_begin_array(writer);
+        write_int(writer, i);
+        write_int(writer, (long long)i * 7919 - 1000000);
+        write_double(writer, i % 10000 / 100.0);
+        write_double(writer, i * 0.001);
+        write_double(writer, 1.0 / (i + 1));
+        write_end_array(writer);
+    }
+    write_end_array(writer);
+    bool finished = finish_writer(writer);
+    double elapsed = now() - start;
+    printf("writer (numbers)       %8.1f MB/s%s\n", length / elapsed / 1e6, finished ? "" : " (failed)");
+    free_writer(writer);
+
+    length = 0;
+    writer = new_writer(count_output, &length);
+    if (!writer)
+        return;
+    char name[64];
+    start = now();
+    write_begin_array(writer);
+    for (unsigned int i = 0; BENCH_RECORDS > i; i++) {
+        snprintf(name, sizeof(name), "record \"%u\"", i);
+        write_begin_object(writer);
+        write_key(writer, "id");
+        write_int(writer, i);
+        write_key(writer, "name");
+        write_string(writer, name);
+        write_key(writer, "score");
+        write_double(writer, i % 1000 + i % 100 / 100.0);
+        write_key(writer, "active");
+        write_bool(writer, i % 2);
+        write_key(writer, "tags");
+        write_begin_array(writer);
+        write_string(writer, "a");
+        write_string(writer, "b");
+        write_null(writer);
+        write_end_array(writer);
+        write_end_object(writer);
+    }
+    write_end_array(writer);
+    finished = finish_writer(writer);
+    elapsed = now() - start;
+    printf("writer (records)       %8.1f MB/s%s\n", length / elapsed / 1e6, finished ? "" : " (failed)");
+    free_writer(writer);
+}
+
+int main(int argc, char **argv)
+{
+    char *code = generate_records(BENCH_RECORDS);
+    if (!code) {
+        fprintf(stderr, "Runtime Error: Couldn't allocate required memory.\n");
+        return EXIT_FAILURE;
+    }
+    size_t length = strlen(code);
+    printf("Document: %zu bytes, %u records\n", length, BENCH_RECORDS);
+
+    bench_parse_parallel(code, length);
+    bench_writer();
+    bench_token_classes();
+
+    free(code);
+    return EXIT_SUCCESS;
+}
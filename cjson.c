@@ -1,25 +1,96 @@
 #include "cjson.h"
 
-unsigned char ERROR_FLAGS;
+_Thread_local unsigned char ERROR_FLAGS;
+_Thread_local JSONError ERROR_INFO;
 
-JSONValue *parse(const char *code)
+// Position of the first error, turned into offset/line/column by locate_error()
+static _Thread_local const char *error_pos;
+
+void reset_error(void)
 {
     ERROR_FLAGS = 0x00;
+    ERROR_INFO.code = JE_NONE;
+    ERROR_INFO.offset = 0;
+    ERROR_INFO.line = 0;
+    ERROR_INFO.column = 0;
+    error_pos = NULL;
+}
+
+// Only the first error is kept. pos may be NULL for the end of the input.
+void set_error(JSONErrorCode code, const char *pos)
+{
+    if (ERROR_INFO.code != JE_NONE)
+        return;
+    ERROR_INFO.code = code;
+    error_pos = pos;
+}
+
+// Fills in ERROR_INFO for an input starting at code. end_char may be NULL
+// for NUL terminated input.
+void locate_error(const char *code, const char *end_char)
+{
+    if (!ERROR_FLAGS)
+        return;
+    if (ERROR_INFO.code == JE_NONE || (ERROR_FLAGS & MEMORY_ALLOCATION_ERROR)) {
+        ERROR_INFO.code = ERROR_FLAGS & MEMORY_ALLOCATION_ERROR ? JE_OUT_OF_MEMORY : JE_UNEXPECTED_TOKEN;
+        error_pos = NULL;
+    }
+    if (!error_pos)
+        error_pos = end_char ? end_char : code + strlen(code);
+
+    ERROR_INFO.offset = error_pos - code;
+    ERROR_INFO.line = 1;
+    const char *line_begin = code;
+    for (const char *current_char = code; error_pos > current_char; current_char++) {
+        if (*current_char == '\n') {
+            ERROR_INFO.line++;
+            line_begin = current_char + 1;
+        }
+    }
+    ERROR_INFO.column = error_pos - line_begin + 1;
+}
+
+const char *error_message(JSONErrorCode code)
+{
+    switch (code) {
+        case JE_NONE:                return "no error";
+        case JE_UNEXPECTED_CHAR:     return "unexpected character";
+        case JE_INVALID_NUMBER:      return "invalid number";
+        case JE_UNTERMINATED_STRING: return "unterminated string";
+        case JE_INVALID_ESCAPE:      return "invalid escape sequence";
+        case JE_UNESCAPED_CONTROL:   return "unescaped control character in string";
+        case JE_UNEXPECTED_TOKEN:    return "unexpected token";
+        case JE_UNEXPECTED_EOF:      return "unexpected end of input";
+        case JE_TRAILING_DATA:       return "unexpected data after the value";
+        case JE_TOO_DEEP:            return "nesting too deep";
+        case JE_INDEX_MISMATCH:      return "index does not match the input";
+        case JE_OUT_OF_MEMORY:       return "out of memory";
+    }
+    return "unknown error";
+}
+
+JSONValue *parse(const char *code)
+{
+    reset_error();
 
     // Tokenize
     Token *tokens = tokenize(code);
     if (ERROR_FLAGS) {
+        locate_error(code, NULL);
         return NULL;
     }
 
     // Create context
     Context context;
     context.current_token = tokens;
+    context.depth = 0;
+    context.index = NULL;
 
     // Parse
     JSONValue *value = json_node(&context);
     free_tokens(context.current_token);
     if (ERROR_FLAGS) {
+        locate_error(code, NULL);
         return NULL;
     }
     return value;
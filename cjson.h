@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -42,6 +43,7 @@ enum TokenKind {
 typedef struct Token Token;
 struct Token {
     TokenKind kind;
+    const char *pos; // ソース上の位置. エラーの報告に使う
     const char *str;
     int str_length;
     long double num;
@@ -50,15 +52,32 @@ struct Token {
 };
 
 Token *tokenize(const char *code);
+Token *tokenize_range(const char *code, const char *end_char);
+const char *tokenize_string(const char *current_char, const char *end_char, const char **next_ptr);
+const char *skip_whitespace(const char *current_char, const char *end_char);
+const char *scan_number(const char *current_char, const char *end_char);
+const char *scan_string(const char *current_char, const char *end_char);
+const char *scan_token(const char *current_char, const char *end_char, TokenKind *kind_ptr);
 void free_tokens(Token *tokens);
 
 
 // ========== context.c ==========
+typedef struct StructuralIndex StructuralIndex;
+
 typedef struct Context Context;
 struct Context {
     Token *current_token;
+    unsigned int depth;
+
+    // Structural index mode: indexがNULLでなければ
+    // current_tokenはindexから読み出したtokenを指す
+    const char *code;
+    const StructuralIndex *index;
+    uint32_t position;
+    Token token;
 };
 
+TokenKind kind_at(const char *code, uint32_t offset);
 bool consume_token(Context *context, TokenKind kind);
 bool consume_number(Context *context, long double *num_ptr);
 bool consume_string(Context *context, const char **str_ptr);
@@ -66,9 +85,12 @@ bool expect_token(Context *context, TokenKind kind);
 bool expect_string(Context *context, const char **str_ptr);
 bool lookahead_token(Context *context, TokenKind kind, unsigned int n);
 bool at_eof(Context *context);
+void load_token(Context *context);
 
 
 // ========== parser.c ==========
+#define MAX_NESTING_DEPTH 1024
+
 typedef enum JSONValueType JSONValueType;
 enum JSONValueType {
     JV_BOOL,
@@ -101,6 +123,9 @@ struct JSONValue {
 
     // Boolean members
     bool value;
+
+    // update_hash()で計算する. オブジェクトのメンバの順序と数値の表記によらない
+    uint64_t hash;
 };
 
 struct JSONMember {
@@ -110,7 +135,10 @@ struct JSONMember {
     JSONMember *next;
 };
 
+JSONValue *new_node(JSONValueType type);
 JSONValue *json_node(Context *context);
+JSONValue *elements_node(Context *context, JSONValue **tail_ptr);
+JSONValue *value_node(Context *context);
 void free_json(JSONValue *value);
 
 
@@ -119,9 +147,169 @@ void free_json(JSONValue *value);
 #define PARSE_ERROR 0x02
 #define MEMORY_ALLOCATION_ERROR 0x04
 #define UNSUPPORTED_ERROR 0x08
+#define WRITE_ERROR 0x10
+
+extern _Thread_local unsigned char ERROR_FLAGS;
 
-extern unsigned char ERROR_FLAGS;
+typedef enum JSONErrorCode JSONErrorCode;
+enum JSONErrorCode {
+    JE_NONE,
+    JE_UNEXPECTED_CHAR,
+    JE_INVALID_NUMBER,
+    JE_UNTERMINATED_STRING,
+    JE_INVALID_ESCAPE,
+    JE_UNESCAPED_CONTROL,
+    JE_UNEXPECTED_TOKEN,
+    JE_UNEXPECTED_EOF,
+    JE_TRAILING_DATA,
+    JE_TOO_DEEP,
+    JE_INDEX_MISMATCH,
+    JE_OUT_OF_MEMORY,
+};
+
+// 最初に見つかったエラー. ERROR_FLAGSと一緒にリセットされる
+typedef struct JSONError JSONError;
+struct JSONError {
+    JSONErrorCode code;
+    size_t offset;       // バイト単位
+    unsigned int line;   // 1から
+    unsigned int column; // 1から, バイト単位
+};
+
+extern _Thread_local JSONError ERROR_INFO;
+
+void reset_error(void);
+void set_error(JSONErrorCode code, const char *pos);
+void locate_error(const char *code, const char *end_char);
+const char *error_message(JSONErrorCode code);
 
 JSONValue *parse(const char *code);
 
+
+// ========== parallel.c ==========
+#ifndef PARALLEL_MIN_CHUNK_SIZE
+#define PARALLEL_MIN_CHUNK_SIZE (1 << 16)
+#endif
+
+JSONValue *parse_parallel(const char *code, unsigned int threads);
+
+
+// ========== index.c ==========
+#define STRUCTURAL_INDEX_INITIAL_CAPACITY 256
+
+// The byte offsets of every token of a buffer. offsetsは永続化しておいて
+// 同じバッファに対して何度でも使える.
+struct StructuralIndex {
+    uint32_t *offsets;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t length; // 索引を作った入力の長さ
+};
+
+StructuralIndex *build_index(const char *code);
+void free_index(StructuralIndex *index);
+bool index_matches(const char *code, const StructuralIndex *index);
+uint32_t skip_indexed_value(const char *code, const StructuralIndex *index, uint32_t position);
+JSONValue *parse_indexed(const char *code, const StructuralIndex *index);
+JSONValue *parse_indexed_value(const char *code, const StructuralIndex *index, uint32_t position);
+
+
+// ========== ingest.c ==========
+#define INGEST_QUEUE_DEPTH 32
+#define INGEST_READERS 4
+#ifndef INGEST_MAX_READ
+#define INGEST_MAX_READ (1 << 30) // io_uringの1回の読み込みの上限
+#endif
+
+// new_ingest() flags
+#define INGEST_THREAD_POOL 0x01 // io_uringを使わない
+
+typedef struct Ingest Ingest;
+
+typedef struct IngestResult IngestResult;
+struct IngestResult {
+    void *user_data;
+    JSONValue *value;          // 失敗したときはNULL
+    unsigned char error_flags; // parse()のERROR_FLAGS
+    JSONError error;           // parse()のERROR_INFO
+    int io_error;              // 読み込みのerrno. 成功したときは0
+};
+
+Ingest *new_ingest(unsigned int parsers, size_t memory_limit, unsigned int flags);
+bool submit_ingest(Ingest *ingest, const char *path, void *user_data);
+bool next_ingest(Ingest *ingest, IngestResult *result);
+void free_ingest(Ingest *ingest);
+
+
+// ========== hash.c ==========
+#define EQUAL_SMALL_OBJECT 16
+
+uint64_t hash_bytes(const char *str);
+void update_hash(JSONValue *value);
+void rehash_json(JSONValue *value);
+bool hash_text(const char *code, uint64_t *hash_ptr);
+bool equal_json(const JSONValue *a, const JSONValue *b);
+char *canonicalize_json(const JSONValue *value);
+
+
+// ========== validate.c ==========
+bool json_validate(const char *buf, size_t len);
+bool validate_indexed(const char *code, const StructuralIndex *index);
+
+
+// ========== document.c ==========
+// 共有される木は変更しないこと
+typedef struct JSONDocument JSONDocument;
+typedef struct JSONDocumentSlot JSONDocumentSlot;
+
+JSONDocument *new_document(JSONValue *root);
+JSONDocument *retain_document(JSONDocument *document);
+void release_document(JSONDocument *document);
+const JSONValue *document_root(const JSONDocument *document);
+JSONDocumentSlot *new_document_slot(JSONDocument *document);
+void free_document_slot(JSONDocumentSlot *slot);
+JSONDocument *acquire_document(JSONDocumentSlot *slot);
+void publish_document(JSONDocumentSlot *slot, JSONDocument *document);
+
+
+// ========== writer.c ==========
+#define WRITER_BUFFER_SIZE (1 << 16)
+
+// 書き込みに失敗したらfalseを返す
+typedef bool (*JSONWriteFunc)(void *user_data, const char *data, size_t size);
+
+typedef struct JSONWriter JSONWriter;
+
+JSONWriter *new_writer(JSONWriteFunc write, void *user_data);
+JSONWriter *new_fd_writer(int fd);
+void free_writer(JSONWriter *writer);
+bool flush_writer(JSONWriter *writer);
+bool finish_writer(JSONWriter *writer);
+bool write_begin_object(JSONWriter *writer);
+bool write_end_object(JSONWriter *writer);
+bool write_begin_array(JSONWriter *writer);
+bool write_end_array(JSONWriter *writer);
+bool write_key(JSONWriter *writer, const char *key);
+bool write_key_length(JSONWriter *writer, const char *key, size_t length);
+bool write_string(JSONWriter *writer, const char *str);
+bool write_string_length(JSONWriter *writer, const char *str, size_t length);
+bool write_int(JSONWriter *writer, long long num);
+bool write_double(JSONWriter *writer, double num);
+bool write_bool(JSONWriter *writer, bool value);
+bool write_null(JSONWriter *writer);
+bool write_value(JSONWriter *writer, const JSONValue *value);
+
+
+// ========== dtoa.c ==========
+#define DTOA_BUFFER_SIZE 32
+size_t format_double(char *buf, double num);
+
+
+// ========== merge.c ==========
+#define MERGE_SMALL_OBJECT 16
+
+JSONValue *merge_patch(JSONValue *target, JSONValue *patch);
+JSONValue *merge_json(JSONValue *base, JSONValue *overlay);
+JSONValue *merge_patch_text(JSONValue *target, const char *patch);
+
 #endif // CJSON_H
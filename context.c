@@ -1,9 +1,79 @@
 #include "cjson.h"
 
+TokenKind kind_at(const char *code, uint32_t offset)
+{
+    switch (code[offset]) {
+        case 'f': return TK_FALSE;
+        case 't': return TK_TRUE;
+        case 'n': return TK_NULL;
+        case '"': return TK_STR;
+        case '[': return TK_BEGIN_ARRAY;
+        case ',': return TK_VALUE_SEP;
+        case ']': return TK_END_ARRAY;
+        case '{': return TK_BEGIN_OBJECT;
+        case ':': return TK_NAME_SEP;
+        case '}': return TK_END_OBJECT;
+        default: return TK_NUM;
+    }
+}
+
+// indexのposition番目のトークンをcontext->tokenに読み出す.
+// 文字列はconsume_string()かexpect_string()で取り出されるまでtokenが所有する.
+void load_token(Context *context)
+{
+    Token *token = &context->token;
+    const StructuralIndex *index = context->index;
+    context->current_token = token;
+    token->next = NULL;
+
+    if (context->position >= index->size) {
+        token->kind = TK_EOF;
+        token->pos = NULL; // 入力の終わり
+        token->str = NULL;
+        token->str_length = 0;
+        return;
+    }
+
+    const char *current_char = context->code + index->offsets[context->position];
+    token->kind = kind_at(context->code, index->offsets[context->position]);
+    token->pos = current_char;
+    token->str = current_char;
+    token->str_length = 1;
+    switch (token->kind) {
+        case TK_FALSE:
+            token->str_length = 5;
+            break;
+        case TK_TRUE:
+        case TK_NULL:
+            token->str_length = 4;
+            break;
+        case TK_NUM:
+            token->num = strtold(current_char, NULL);
+            token->str_length = 0;
+            break;
+        case TK_STR:
+            if (!(token->str = tokenize_string(current_char, NULL, &current_char))) {
+                // 文字列はbuild_index()で検査済みなのでメモリ不足のときだけ
+                token->kind = TK_EOF;
+                token->str_length = 0;
+                return;
+            }
+            token->str_length = strlen(token->str);
+            break;
+        default:
+            break;
+    }
+}
+
 static void advance_token(Context *context)
 {
     if (context->current_token->kind == TK_EOF)
         return;
+    if (context->index) {
+        context->position++;
+        load_token(context);
+        return;
+    }
     Token *previous_token = context->current_token;
     context->current_token = context->current_token->next;
     free(previous_token);
@@ -38,13 +108,19 @@ bool consume_string(Context *context, const char **str_ptr)
     return false;
 }
 
+static void unexpected_token(Context *context)
+{
+    set_error(at_eof(context) ? JE_UNEXPECTED_EOF : JE_UNEXPECTED_TOKEN, context->current_token->pos);
+    ERROR_FLAGS |= PARSE_ERROR;
+}
+
 bool expect_token(Context *context, TokenKind kind)
 {
     if (context->current_token->kind == kind) {
         advance_token(context);
         return true;
     }
-    ERROR_FLAGS |= PARSE_ERROR;
+    unexpected_token(context);
     return false;
 }
 
@@ -55,12 +131,19 @@ bool expect_string(Context *context, const char **str_ptr)
         advance_token(context);
         return true;
     }
-    ERROR_FLAGS |= PARSE_ERROR;
+    unexpected_token(context);
     return false;
 }
 
 bool lookahead_token(Context *context, TokenKind kind, unsigned int n)
 {
+    if (context->index) {
+        const StructuralIndex *index = context->index;
+        if (context->position + n >= index->size)
+            return kind == TK_EOF && context->position + n == index->size;
+        return kind_at(context->code, index->offsets[context->position + n]) == kind;
+    }
+
     Token *token = context->current_token;
     for (unsigned int i = 0; n > i; i++) {
         token = token->next;
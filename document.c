@@ -0,0 +1,133 @@
+#include <stdatomic.h>
+#include <threads.h>
+#include "cjson.h"
+
+// Shared immutable documents.
+//
+// A JSONDocument owns a parsed tree and an atomic reference count; the tree
+// is freed by the last release_document().  Once a tree is put into a
+// document it must not be changed, so any number of threads can read it
+// without locks.
+//
+// A JSONDocumentSlot holds the current document of e.g. a config cache.
+// acquire_document() is lock-free: a reader announces itself in the reader
+// count of the current epoch, loads the document and retains it.  It only
+// retries when a publish happens at the same moment.
+// publish_document() swaps in the new document, flips the epoch and waits
+// until the readers of the old epoch are gone before dropping the slot's
+// reference to the old document.  Readers that still hold it keep it alive
+// until they release it.
+
+struct JSONDocument {
+    atomic_ulong references;
+    JSONValue *root;
+};
+
+struct JSONDocumentSlot {
+    _Atomic(JSONDocument *) document;
+    atomic_uint epoch;
+    atomic_ulong readers[2];
+    mtx_t publish_lock; // publish_document()同士だけ
+};
+
+JSONDocument *new_document(JSONValue *root)
+{
+    if (!root)
+        return NULL;
+
+    JSONDocument *document = malloc(sizeof(JSONDocument));
+    if (!document) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free_json(root);
+        return NULL;
+    }
+    atomic_init(&document->references, 1);
+    document->root = root;
+    return document;
+}
+
+JSONDocument *retain_document(JSONDocument *document)
+{
+    if (document)
+        atomic_fetch_add_explicit(&document->references, 1, memory_order_relaxed);
+    return document;
+}
+
+void release_document(JSONDocument *document)
+{
+    if (!document)
+        return;
+    if (atomic_fetch_sub_explicit(&document->references, 1, memory_order_acq_rel) == 1) {
+        free_json(document->root);
+        free(document);
+    }
+}
+
+const JSONValue *document_root(const JSONDocument *document)
+{
+    return document->root;
+}
+
+JSONDocumentSlot *new_document_slot(JSONDocument *document)
+{
+    JSONDocumentSlot *slot = malloc(sizeof(JSONDocumentSlot));
+    if (!slot) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    if (mtx_init(&slot->publish_lock, mtx_plain) != thrd_success) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free(slot);
+        return NULL;
+    }
+    atomic_init(&slot->document, document);
+    atomic_init(&slot->epoch, 0);
+    atomic_init(&slot->readers[0], 0);
+    atomic_init(&slot->readers[1], 0);
+    return slot;
+}
+
+// The slot must not be used by other threads any more.
+void free_document_slot(JSONDocumentSlot *slot)
+{
+    if (!slot)
+        return;
+    release_document(atomic_load(&slot->document));
+    mtx_destroy(&slot->publish_lock);
+    free(slot);
+}
+
+// Returns the current document retained for the caller, or NULL when the
+// slot is empty.  The caller releases it with release_document().
+JSONDocument *acquire_document(JSONDocumentSlot *slot)
+{
+    unsigned int epoch;
+    while (true) {
+        epoch = atomic_load(&slot->epoch);
+        atomic_fetch_add(&slot->readers[epoch & 1], 1);
+        // 数える前にepochが変わっていたら, そのpublisherに見落とされている
+        if (atomic_load(&slot->epoch) == epoch)
+            break;
+        atomic_fetch_sub(&slot->readers[epoch & 1], 1);
+    }
+    JSONDocument *document = retain_document(atomic_load(&slot->document));
+    atomic_fetch_sub(&slot->readers[epoch & 1], 1);
+    return document;
+}
+
+// Replaces the current document.  The slot takes over the caller's
+// reference to document, which may be NULL to empty the slot.
+void publish_document(JSONDocumentSlot *slot, JSONDocument *document)
+{
+    mtx_lock(&slot->publish_lock);
+    JSONDocument *old_document = atomic_exchange(&slot->document, document);
+
+    // 交換の前にepochを読んだreaderは古いepochで数えられている.
+    // 新しいepochのreaderは新しいdocumentしか読まない
+    unsigned int epoch = atomic_fetch_add(&slot->epoch, 1) & 1;
+    while (atomic_load(&slot->readers[epoch]))
+        thrd_yield();
+    mtx_unlock(&slot->publish_lock);
+
+    release_document(old_document);
+}
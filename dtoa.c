@@ -0,0 +1,386 @@
+#include <math.h>
+#include "cjson.h"
+
+// Shortest round-trip formatting of doubles.
+//
+// format_double() writes the shortest decimal that reads back as the same
+// double, laid out like ECMAScript's Number.prototype.toString(), which is
+// also the number format of RFC 8785.  The digits come from Grisu3 (Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers",
+// PLDI 2010), which only needs 64-bit integer arithmetic.  For about 0.5% of
+// all doubles Grisu3 cannot prove that its digits are the shortest; those
+// fall back to trying snprintf() precisions until strtod() gives the number
+// back.
+
+typedef struct DiyFp DiyFp;
+struct DiyFp {
+    uint64_t f;
+    int e; // f * 2^e
+};
+
+typedef struct CachedPower CachedPower;
+struct CachedPower {
+    uint64_t f;
+    int e;
+    int k; // f * 2^e = 10^k を最も近い値に丸めたもの
+};
+
+#define CACHED_POWERS_OFFSET 348
+#define CACHED_POWERS_STEP 8
+
+static const CachedPower CACHED_POWERS[] = {
+    { 0xFA8FD5A0081C0288ULL, -1220, -348 },
+    { 0xBAAEE17FA23EBF76ULL, -1193, -340 },
+    { 0x8B16FB203055AC76ULL, -1166, -332 },
+    { 0xCF42894A5DCE35EAULL, -1140, -324 },
+    { 0x9A6BB0AA55653B2DULL, -1113, -316 },
+    { 0xE61ACF033D1A45DFULL, -1087, -308 },
+    { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+    { 0xBE5691EF416BD60CULL, -1007, -284 },
+    { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+    { 0xD3515C2831559A83ULL,  -954, -268 },
+    { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+    { 0xEA9C227723EE8BCBULL,  -901, -252 },
+    { 0xAECC49914078536DULL,  -874, -244 },
+    { 0x823C12795DB6CE57ULL,  -847, -236 },
+    { 0xC21094364DFB5637ULL,  -821, -228 },
+    { 0x9096EA6F3848984FULL,  -794, -220 },
+    { 0xD77485CB25823AC7ULL,  -768, -212 },
+    { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+    { 0xEF340A98172AACE5ULL,  -715, -196 },
+    { 0xB23867FB2A35B28EULL,  -688, -188 },
+    { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+    { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+    { 0x936B9FCEBB25C996ULL,  -608, -164 },
+    { 0xDBAC6C247D62A584ULL,  -582, -156 },
+    { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+    { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+    { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+    { 0x87625F056C7C4A8BULL,  -475, -124 },
+    { 0xC9BCFF6034C13053ULL,  -449, -116 },
+    { 0x964E858C91BA2655ULL,  -422, -108 },
+    { 0xDFF9772470297EBDULL,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+    { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+    { 0xB94470938FA89BCFULL,  -316,  -76 },
+    { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+    { 0xCDB02555653131B6ULL,  -263,  -60 },
+    { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+    { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+    { 0xAA242499697392D3ULL,  -183,  -36 },
+    { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+    { 0xBCE5086492111AEBULL,  -130,  -20 },
+    { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+    { 0xD1B71758E219652CULL,   -77,   -4 },
+    { 0x9C40000000000000ULL,   -50,    4 },
+    { 0xE8D4A51000000000ULL,   -24,   12 },
+    { 0xAD78EBC5AC620000ULL,     3,   20 },
+    { 0x813F3978F8940984ULL,    30,   28 },
+    { 0xC097CE7BC90715B3ULL,    56,   36 },
+    { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+    { 0xD5D238A4ABE98068ULL,   109,   52 },
+    { 0x9F4F2726179A2245ULL,   136,   60 },
+    { 0xED63A231D4C4FB27ULL,   162,   68 },
+    { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+    { 0x83C7088E1AAB65DBULL,   216,   84 },
+    { 0xC45D1DF942711D9AULL,   242,   92 },
+    { 0x924D692CA61BE758ULL,   269,  100 },
+    { 0xDA01EE641A708DEAULL,   295,  108 },
+    { 0xA26DA3999AEF774AULL,   322,  116 },
+    { 0xF209787BB47D6B85ULL,   348,  124 },
+    { 0xB454E4A179DD1877ULL,   375,  132 },
+    { 0x865B86925B9BC5C2ULL,   402,  140 },
+    { 0xC83553C5C8965D3DULL,   428,  148 },
+    { 0x952AB45CFA97A0B3ULL,   455,  156 },
+    { 0xDE469FBD99A05FE3ULL,   481,  164 },
+    { 0xA59BC234DB398C25ULL,   508,  172 },
+    { 0xF6C69A72A3989F5CULL,   534,  180 },
+    { 0xB7DCBF5354E9BECEULL,   561,  188 },
+    { 0x88FCF317F22241E2ULL,   588,  196 },
+    { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+    { 0x98165AF37B2153DFULL,   641,  212 },
+    { 0xE2A0B5DC971F303AULL,   667,  220 },
+    { 0xA8D9D1535CE3B396ULL,   694,  228 },
+    { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+    { 0xBB764C4CA7A44410ULL,   747,  244 },
+    { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+    { 0xD01FEF10A657842CULL,   800,  260 },
+    { 0x9B10A4E5E9913129ULL,   827,  268 },
+    { 0xE7109BFBA19C0C9DULL,   853,  276 },
+    { 0xAC2820D9623BF429ULL,   880,  284 },
+    { 0x80444B5E7AA7CF85ULL,   907,  292 },
+    { 0xBF21E44003ACDD2DULL,   933,  300 },
+    { 0x8E679C2F5E44FF8FULL,   960,  308 },
+    { 0xD433179D9C8CB841ULL,   986,  316 },
+    { 0x9E19DB92B4E31BA9ULL,  1013,  324 },
+    { 0xEB96BF6EBADF77D9ULL,  1039,  332 },
+    { 0xAF87023B9BF0EE6BULL,  1066,  340 },
+};
+
+// Digits are generated for w * 10^-k with the exponent in
+// [DTOA_MIN_EXPONENT, DTOA_MAX_EXPONENT], so the integral part fits in 32
+// bits.
+#define DTOA_MIN_EXPONENT -60
+#define DTOA_MAX_EXPONENT -32
+
+#define DOUBLE_FRACTION_MASK ((1ULL << 52) - 1)
+#define DOUBLE_HIDDEN_BIT (1ULL << 52)
+
+// The product rounded to 64 bits, so the error is at most half a unit.
+static DiyFp multiply(DiyFp x, DiyFp y)
+{
+    uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF;
+    uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF) + (1ULL << 31);
+    DiyFp product = { ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64 };
+    return product;
+}
+
+static DiyFp normalize(DiyFp x)
+{
+    while (!(x.f & 0xFFC0000000000000ULL)) {
+        x.f <<= 10;
+        x.e -= 10;
+    }
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// Moves the last digit towards w while the digits stay inside the interval,
+// and checks that the result is the closest shortest one.
+// distance is (high - w) and rest is (high - digits), ten_kappa is the
+// weight of the last digit, all scaled by unit.
+static bool round_weed(char *digits, int length, uint64_t distance, uint64_t unsafe_interval,
+                       uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small_distance = distance - unit;
+    uint64_t big_distance = distance + unit;
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa
+           && (rest + ten_kappa < small_distance
+               || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    // wの誤差の範囲内に別の候補があれば, どちらが近いか決められない
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa
+        && (rest + ten_kappa < big_distance
+            || big_distance - rest > rest + ten_kappa - big_distance))
+        return false;
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+// Generates the shortest digits in (low, high), which carry an error of one
+// unit each.  The value is digits * 10^kappa.  Returns false when the error
+// makes the result uncertain.
+static bool generate_digits(DiyFp low, DiyFp w, DiyFp high, char *digits, int *length_ptr,
+                            int *kappa_ptr)
+{
+    uint64_t unit = 1;
+    DiyFp too_low = { low.f - unit, low.e };
+    DiyFp too_high = { high.f + unit, high.e };
+    uint64_t unsafe_interval = too_high.f - too_low.f;
+    int shift = -w.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t integrals = too_high.f >> shift;
+    uint64_t fractionals = too_high.f & (one - 1);
+
+    uint32_t divisor = 1;
+    int kappa = 1;
+    while (integrals / divisor >= 10) {
+        divisor *= 10;
+        kappa++;
+    }
+
+    int length = 0;
+    while (kappa > 0) {
+        digits[length++] = '0' + integrals / divisor;
+        integrals %= divisor;
+        kappa--;
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            *length_ptr = length;
+            *kappa_ptr = kappa;
+            return round_weed(digits, length, too_high.f - w.f, unsafe_interval, rest,
+                              (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+    while (true) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[length++] = '0' + (fractionals >> shift);
+        fractionals &= one - 1;
+        kappa--;
+        if (fractionals < unsafe_interval) {
+            *length_ptr = length;
+            *kappa_ptr = kappa;
+            return round_weed(digits, length, (too_high.f - w.f) * unit, unsafe_interval,
+                              fractionals, one, unit);
+        }
+    }
+}
+
+// Shortest digits of a positive finite num; num = digits * 10^exponent.
+static bool grisu3(double num, char *digits, int *length_ptr, int *exponent_ptr)
+{
+    uint64_t bits;
+    memcpy(&bits, &num, sizeof(bits));
+    uint64_t fraction = bits & DOUBLE_FRACTION_MASK;
+    int biased_exponent = bits >> 52 & 0x7FF;
+    DiyFp v;
+    if (biased_exponent) {
+        v.f = fraction | DOUBLE_HIDDEN_BIT;
+        v.e = biased_exponent - 1075;
+    }
+    else {
+        v.f = fraction;
+        v.e = -1074;
+    }
+
+    // 隣のdoubleとの中点. 2の冪のすぐ下のdoubleは間隔が半分
+    DiyFp plus = { (v.f << 1) + 1, v.e - 1 };
+    plus = normalize(plus);
+    DiyFp minus;
+    if (!fraction && biased_exponent > 1) {
+        minus.f = (v.f << 2) - 1;
+        minus.e = v.e - 2;
+    }
+    else {
+        minus.f = (v.f << 1) - 1;
+        minus.e = v.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    DiyFp w = normalize(v);
+
+    int k = (int)ceil((DTOA_MIN_EXPONENT - (w.e + 64) + 63) * 0.30102999566398114);
+    const CachedPower *cached = &CACHED_POWERS[(CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_STEP + 1];
+    DiyFp power = { cached->f, cached->e };
+
+    int kappa;
+    if (!generate_digits(multiply(minus, power), multiply(w, power), multiply(plus, power),
+                         digits, length_ptr, &kappa))
+        return false;
+    *exponent_ptr = kappa - cached->k;
+    return true;
+}
+
+static bool round_trips(double num, int precision, char *buf)
+{
+    snprintf(buf, 32, "%.*e", precision - 1, num);
+    return strtod(buf, NULL) == num;
+}
+
+// Finds the shortest precision with snprintf() and strtod(), starting from
+// the length Grisu3 gave up on, which is rarely off by more than one.
+// 17桁あれば必ず同じdoubleに戻る
+static void shortest_digits_slow(double num, char *digits, int *length_ptr, int *exponent_ptr)
+{
+    char buf[32];
+    int precision = *length_ptr;
+    if (precision < 1 || precision > 17)
+        precision = 17;
+    if (round_trips(num, precision, buf)) {
+        char shorter[32];
+        while (precision > 1 && round_trips(num, precision - 1, shorter)) {
+            memcpy(buf, shorter, sizeof(buf));
+            precision--;
+        }
+    }
+    else {
+        while (!round_trips(num, ++precision, buf))
+            ;
+    }
+
+    int length = 0;
+    char *p = buf;
+    for (; *p != 'e'; p++)
+        if (isdigit((unsigned char)*p))
+            digits[length++] = *p;
+    *length_ptr = length;
+    *exponent_ptr = atoi(p + 1) - (length - 1);
+}
+
+// Writes num, which must be finite, into buf and returns the length.  buf
+// needs DTOA_BUFFER_SIZE bytes; no '\0' is written.
+size_t format_double(char *buf, double num)
+{
+    char *p = buf;
+    if (signbit(num)) {
+        *p++ = '-';
+        num = -num;
+    }
+    if (num == 0) {
+        *p++ = '0';
+        return p - buf;
+    }
+
+    char digits[20];
+    int length, exponent;
+    if (num < 9007199254740992.0 && num == (double)(uint64_t)num) { // 2^53未満の整数
+        uint64_t integer = (uint64_t)num;
+        char *end = digits + sizeof(digits);
+        char *first = end;
+        for (; integer; integer /= 10)
+            *--first = '0' + integer % 10;
+        length = end - first;
+        memmove(digits, first, length);
+        exponent = 0;
+    }
+    else if (!grisu3(num, digits, &length, &exponent)) {
+        shortest_digits_slow(num, digits, &length, &exponent);
+    }
+    while (length > 1 && digits[length - 1] == '0') {
+        length--;
+        exponent++;
+    }
+
+    // num = 0.digits * 10^n
+    int n = length + exponent;
+    if (length <= n && n <= 21) {
+        memcpy(p, digits, length);
+        p += length;
+        for (int i = length; n > i; i++)
+            *p++ = '0';
+    }
+    else if (0 < n && n <= 21) {
+        memcpy(p, digits, n);
+        p += n;
+        *p++ = '.';
+        memcpy(p, digits + n, length - n);
+        p += length - n;
+    }
+    else if (-6 < n && n <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = n; 0 > i; i++)
+            *p++ = '0';
+        memcpy(p, digits, length);
+        p += length;
+    }
+    else {
+        *p++ = digits[0];
+        if (length > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        int e = n - 1;
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        if (e < 0)
+            e = -e;
+        if (e >= 100)
+            *p++ = '0' + e / 100;
+        if (e >= 10)
+            *p++ = '0' + e / 10 % 10;
+        *p++ = '0' + e % 10;
+    }
+    return p - buf;
+}
@@ -0,0 +1,381 @@
+#include <stdint.h>
+#include <math.h>
+#include "cjson.h"
+
+// Fuzzing harness for parse().
+//
+// Built with -DLIBFUZZER -fsanitize=fuzzer (libFuzzer, or AFL++ through its
+// libFuzzer driver) LLVMFuzzerTestOneInput() is the entry point.  Otherwise
+// main() replays the files given on the command line, so the seed corpus in
+// test/corpus can be run offline.  Seeds follow the JSONTestSuite naming:
+// y_ must be accepted, n_ must be rejected, i_ may go either way.  Every y_
+// seed also has a .canonical file with its expected canonicalize_json()
+// output, so the decoder is checked against a reference and not only
+// against itself.
+//
+// Every accepted document is serialized again and reparsed; both trees must
+// be identical and hash alike, canonicalize_json() must be idempotent and
+// the output of write_value() must read back as the same values.  Patching
+// the document onto itself with merge_patch() and merge_patch_text() must
+// give the same tree with up to date hashes.  The other parsing paths must
+// agree with parse() on every input: parse_parallel() (built with a tiny
+// PARALLEL_MIN_CHUNK_SIZE so that small arrays get split too),
+// parse_indexed(), validate_indexed() and json_validate().  Every rejection
+// must come with an error code and a location inside the input, and a
+// rejected patch must leave the target of merge_patch_text() unchanged.
+
+#define FUZZ_THREADS 4
+
+static bool append_output(void *user_data, const char *data, size_t size)
+{
+    for (size_t i = 0; size > i; i++)
+        if (!append_sb(user_data, data[i]))
+            return false;
+    return true;
+}
+
+static bool same_json(JSONValue *a, JSONValue *b)
+{
+    if (a->type != b->type)
+        return false;
+    switch (a->type) {
+        case JV_BOOL:
+            return a->value == b->value;
+        case JV_NULL:
+            return true;
+        case JV_NUM:
+            if (isnan(a->num))
+                return isnan(b->num);
+            return a->num == b->num;
+        case JV_STR:
+            return !strcmp(a->str, b->str);
+        case JV_ARRAY: {
+            JSONValue *x = a->elements, *y = b->elements;
+            for (; x && y; x = x->next, y = y->next)
+                if (!same_json(x, y))
+                    return false;
+            return !x && !y;
+        }
+        case JV_OBJECT: {
+            JSONMember *x = a->members, *y = b->members;
+            for (; x && y; x = x->next, y = y->next)
+                if (strcmp(x->key, y->key) || !same_json(x->value, y->value))
+                    return false;
+            return !x && !y;
+        }
+    }
+    return false;
+}
+
+static bool append_str(StringBuilder *sb, const char *str)
+{
+    for (; *str; str++)
+        if (!append_sb(sb, *str))
+            return false;
+    return true;
+}
+
+static bool serialize_string(StringBuilder *sb, const char *str)
+{
+    if (!append_sb(sb, '"'))
+        return false;
+    char buf[8];
+    for (; *str; str++) {
+        if ((unsigned char)*str < 0x20) {
+            snprintf(buf, sizeof(buf), "\\u%04X", (unsigned char)*str);
+            for (char *p = buf; *p; p++)
+                if (!append_sb(sb, *p))
+                    return false;
+            continue;
+        }
+        if ((*str == '"' || *str == '\\') && !append_sb(sb, '\\'))
+            return false;
+        if (!append_sb(sb, *str))
+            return false;
+    }
+    return append_sb(sb, '"');
+}
+
+static bool serialize(StringBuilder *sb, JSONValue *value)
+{
+    char buf[64];
+    switch (value->type) {
+        case JV_BOOL:
+            return append_str(sb, value->value ? "true" : "false");
+        case JV_NULL:
+            return append_str(sb, "null");
+        case JV_NUM:
+            if (isinf(value->num))
+                return append_str(sb, value->num < 0 ? "-1e999999" : "1e999999");
+            snprintf(buf, sizeof(buf), "%.21Lg", value->num);
+            return append_str(sb, buf);
+        case JV_STR:
+            return serialize_string(sb, value->str);
+        case JV_ARRAY:
+            if (!append_sb(sb, '['))
+                return false;
+            for (JSONValue *current = value->elements; current; current = current->next) {
+                if (current != value->elements && !append_sb(sb, ','))
+                    return false;
+                if (!serialize(sb, current))
+                    return false;
+            }
+            return append_sb(sb, ']');
+        case JV_OBJECT:
+            if (!append_sb(sb, '{'))
+                return false;
+            for (JSONMember *current = value->members; current; current = current->next) {
+                if (current != value->members && !append_sb(sb, ','))
+                    return false;
+                if (!serialize_string(sb, current->key) || !append_sb(sb, ':'))
+                    return false;
+                if (!serialize(sb, current->value))
+                    return false;
+            }
+            return append_sb(sb, '}');
+    }
+    return false;
+}
+
+static void diverged(const char *path, const char *code)
+{
+    fprintf(stderr, "Divergence: %s disagrees with parse().\n", path);
+    fprintf(stderr, "Input: %s\n", code);
+    abort();
+}
+
+static void check_path(const char *path, JSONValue *expected, unsigned char expected_flags,
+                       JSONValue *value, const char *code)
+{
+    if (ERROR_FLAGS != expected_flags || !expected != !value)
+        diverged(path, code);
+    if (expected && !same_json(expected, value))
+        diverged(path, code);
+    free_json(value);
+}
+
+// Returns whether the input was accepted, aborts on divergence.
+static bool check_input(const char *code)
+{
+    JSONValue *value = parse(code);
+    unsigned char flags = ERROR_FLAGS;
+    size_t length = strlen(code);
+    if (flags && (ERROR_INFO.code == JE_NONE || ERROR_INFO.offset > length))
+        diverged("ERROR_INFO", code);
+
+    if (json_validate(code, length) != (value && !flags))
+        diverged("json_validate()", code);
+    if (ERROR_FLAGS && (ERROR_INFO.code == JE_NONE || ERROR_INFO.offset > length))
+        diverged("json_validate() ERROR_INFO", code);
+
+    check_path("parse_parallel()", value, flags, parse_parallel(code, FUZZ_THREADS), code);
+
+    StructuralIndex *index = build_index(code);
+    if (index) {
+        if (value && skip_indexed_value(code, index, 0) != index->size)
+            diverged("skip_indexed_value()", code);
+        check_path("parse_indexed()", value, flags, parse_indexed(code, index), code);
+        if (validate_indexed(code, index) != (value && !flags))
+            diverged("validate_indexed()", code);
+        free_index(index);
+    }
+    else if (!(flags & TOKENIZE_ERROR) || ERROR_FLAGS != flags) {
+        diverged("build_index()", code);
+    }
+
+    if (!value || flags) {
+        // A rejected patch must leave the target alone
+        JSONValue *target = parse("{ \"a\": { \"b\": 1 }, \"c\": [ 2 ] }");
+        uint64_t target_hash = target ? target->hash : 0;
+        if (!target || merge_patch_text(target, code) || !(ERROR_FLAGS & (TOKENIZE_ERROR | PARSE_ERROR)))
+            diverged("merge_patch_text() of a rejected patch", code);
+        if (ERROR_INFO.code == JE_NONE || ERROR_INFO.offset > length)
+            diverged("merge_patch_text() ERROR_INFO", code);
+        rehash_json(target);
+        if (target->hash != target_hash)
+            diverged("merge_patch_text() changed the target of a rejected patch", code);
+        free_json(target);
+        free_json(value);
+        return false;
+    }
+
+    StringBuilder builder;
+    if (!initial_sb(&builder) || !serialize(&builder, value) || !get_str_sb(&builder)) {
+        fprintf(stderr, "Runtime Error: Couldn't allocate required memory.\n");
+        abort();
+    }
+
+    JSONValue *reparsed = parse(builder.str);
+    if (!reparsed || ERROR_FLAGS || !same_json(value, reparsed)) {
+        fprintf(stderr, "Divergence: round trip of accepted input changed the tree.\n");
+        fprintf(stderr, "Serialized: %s\n", builder.str);
+        abort();
+    }
+    if (!equal_json(value, reparsed))
+        diverged("equal_json()", code);
+
+    uint64_t hash = value->hash;
+    rehash_json(value);
+    if (value->hash != hash)
+        diverged("rehash_json()", code);
+    if (!hash_text(code, &hash) || hash != value->hash)
+        diverged("hash_text()", code);
+
+    char *canonical = canonicalize_json(value);
+    if (canonical) {
+        JSONValue *canonical_value = parse(canonical);
+        char *again = canonical_value ? canonicalize_json(canonical_value) : NULL;
+        if (!again || strcmp(canonical, again))
+            diverged("canonicalize_json()", code);
+        free(again);
+        // The canonical text must denote the same value for equal_json() too
+        if (canonical_value && !equal_json(value, canonical_value))
+            diverged("equal_json() of the canonical form", code);
+        free_json(canonical_value);
+
+        // write_value() must write the same values
+        StringBuilder output;
+        JSONWriter *writer = initial_sb(&output) ? new_writer(append_output, &output) : NULL;
+        if (!writer) {
+            fprintf(stderr, "Runtime Error: Couldn't allocate required memory.\n");
+            abort();
+        }
+        if (!write_value(writer, value) || !finish_writer(writer) || !get_str_sb(&output))
+            diverged("write_value()", code);
+        JSONValue *written = parse(output.str);
+        again = written ? canonicalize_json(written) : NULL;
+        if (!again || strcmp(canonical, again))
+            diverged("write_value()", code);
+        free(again);
+        free_json(written);
+        free_writer(writer);
+        free(output.str);
+        free(canonical);
+    }
+
+    // The input patched onto itself, as a tree and as text
+    JSONValue *patched = merge_patch(reparsed, parse(code));
+    JSONValue *streamed = merge_patch_text(parse(code), code);
+    if (!patched || !streamed || !equal_json(patched, streamed))
+        diverged("merge_patch_text()", code);
+    if (patched) {
+        hash = patched->hash;
+        rehash_json(patched);
+        if (patched->hash != hash)
+            diverged("merge_patch()", code);
+    }
+
+    free_json(patched);
+    free_json(streamed);
+    free_json(value);
+    free(builder.str);
+    return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *code = malloc(size + 1);
+    if (!code)
+        return 0;
+    memcpy(code, data, size);
+    code[size] = '\0';
+
+    check_input(code);
+
+    free(code);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+static char *read_file(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return NULL;
+
+    StringBuilder builder;
+    if (!initial_sb(&builder)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (!append_sb(&builder, c)) {
+            free(builder.str);
+            fclose(fp);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    if (!get_str_sb(&builder)) {
+        free(builder.str);
+        return NULL;
+    }
+    return builder.str;
+}
+
+// y_ seeds come with their RFC 8785 form in a .canonical file next to them,
+// written by an implementation independent of this library.
+static bool check_canonical(const char *filename, const char *code)
+{
+    size_t length = strlen(filename);
+    if (length < 5 || strcmp(filename + length - 5, ".json")) {
+        fprintf(stderr, "Missing canonical form: %s\n", filename);
+        return false;
+    }
+    char *path = malloc(length + 6);
+    if (!path) {
+        fprintf(stderr, "Runtime Error: Couldn't allocate required memory.\n");
+        abort();
+    }
+    sprintf(path, "%.*s.canonical", (int)(length - 5), filename);
+    char *expected = read_file(path);
+    if (!expected)
+        fprintf(stderr, "Missing canonical form: %s\n", path);
+    free(path);
+    if (!expected)
+        return false;
+
+    JSONValue *value = parse(code);
+    char *canonical = value ? canonicalize_json(value) : NULL;
+    bool matched = canonical && !strcmp(canonical, expected);
+    if (!matched)
+        fprintf(stderr, "Wrong canonical form: %s\nExpected: %s\nActual:   %s\n",
+                filename, expected, canonical ? canonical : "(none)");
+    free(canonical);
+    free_json(value);
+    free(expected);
+    return matched;
+}
+
+int main(int argc, char **argv)
+{
+    int failures = 0;
+    for (int i = 1; argc > i; i++) {
+        char *code = read_file(argv[i]);
+        if (!code) {
+            fprintf(stderr, "Runtime Error: Couldn't read the file named \"%s\".\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        const char *name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+
+        bool accepted = check_input(code);
+        if ((name[0] == 'y' && !accepted) || (name[0] == 'n' && accepted)) {
+            fprintf(stderr, "Unexpected %s: %s\n", accepted ? "acceptance" : "rejection", argv[i]);
+            failures++;
+        }
+        else if (name[0] == 'y' && !check_canonical(argv[i], code)) {
+            failures++;
+        }
+        free(code);
+    }
+
+    printf("Fuzz corpus: %d inputs, %d failures\n", argc - 1, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif // LIBFUZZER
@@ -0,0 +1,509 @@
+#include <math.h>
+#include "cjson.h"
+
+// Structural hashing, equality and canonical serialization.
+//
+// Every JSONValue carries a 64-bit hash that the parser computes bottom-up as
+// it creates nodes. Object members are combined with a commutative sum so the
+// member order does not matter, and numbers are hashed by the value of their
+// nearest double, so 1, 1.0 and 10e-1 hash alike. Trees modified after
+// parsing must be brought up to date with update_hash() or rehash_json()
+// before equal_json() is used.
+//
+// canonicalize_json() writes the RFC 8785 (JCS) form of a tree.
+
+#define HASH_TAG_BOOL   0x626f6f6cULL
+#define HASH_TAG_NULL   0x6e756c6cULL
+#define HASH_TAG_NUM    0x6e756d62ULL
+#define HASH_TAG_STR    0x73747269ULL
+#define HASH_TAG_ARRAY  0x61727261ULL
+#define HASH_TAG_OBJECT 0x6f626a65ULL
+
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t hash_bytes(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_bool(bool value)
+{
+    return mix64(HASH_TAG_BOOL + value);
+}
+
+static uint64_t hash_null(void)
+{
+    return mix64(HASH_TAG_NULL);
+}
+
+// Numbers are identified by their nearest double, as in RFC 8785, so that
+// hashing and equal_json() agree with canonicalize_json().
+static uint64_t hash_number(long double value)
+{
+    double num = (double)value;
+    if (num == 0)
+        return mix64(HASH_TAG_NUM);
+    if (isnan(num))
+        return mix64(HASH_TAG_NUM + 1);
+    if (isinf(num))
+        return mix64(HASH_TAG_NUM + (num > 0 ? 2 : 3));
+
+    int exponent;
+    double mantissa = frexp(fabs(num), &exponent);
+    uint64_t bits = (uint64_t)(mantissa * 18446744073709551616.0);
+    return mix64(mix64(HASH_TAG_NUM ^ bits) + (uint64_t)exponent * 2 + (num < 0));
+}
+
+static uint64_t hash_str(const char *str)
+{
+    return mix64(HASH_TAG_STR ^ hash_bytes(str));
+}
+
+static uint64_t hash_element(uint64_t hash, uint64_t element_hash)
+{
+    return mix64(hash + element_hash);
+}
+
+// Members are summed, so the order in which they are added does not matter.
+static uint64_t hash_member(uint64_t hash, const char *key, uint64_t value_hash)
+{
+    return hash + mix64(hash_bytes(key) * 31 + value_hash);
+}
+
+// Recomputes the hash of value from its contents and the hashes of its
+// direct children.
+void update_hash(JSONValue *value)
+{
+    uint64_t hash = 0;
+    switch (value->type) {
+        case JV_BOOL:
+            value->hash = hash_bool(value->value);
+            return;
+        case JV_NULL:
+            value->hash = hash_null();
+            return;
+        case JV_NUM:
+            value->hash = hash_number(value->num);
+            return;
+        case JV_STR:
+            value->hash = hash_str(value->str);
+            return;
+        case JV_ARRAY:
+            hash = HASH_TAG_ARRAY;
+            for (JSONValue *current = value->elements; current; current = current->next)
+                hash = hash_element(hash, current->hash);
+            value->hash = mix64(hash);
+            return;
+        case JV_OBJECT:
+            for (JSONMember *current = value->members; current; current = current->next)
+                hash = hash_member(hash, current->key, current->value->hash);
+            value->hash = mix64(HASH_TAG_OBJECT ^ hash);
+            return;
+    }
+}
+
+// Recomputes all hashes of a tree.
+void rehash_json(JSONValue *value)
+{
+    if (!value)
+        return;
+    if (value->type == JV_ARRAY)
+        for (JSONValue *current = value->elements; current; current = current->next)
+            rehash_json(current);
+    if (value->type == JV_OBJECT)
+        for (JSONMember *current = value->members; current; current = current->next)
+            rehash_json(current->value);
+    update_hash(value);
+}
+
+// Same grammar as value_node(), but only the hash is kept.
+static bool hash_value(Context *context, uint64_t *hash_ptr)
+{
+    long double num;
+    const char *str;
+    const char *pos = context->current_token->pos;
+    if (consume_token(context, TK_FALSE)) {
+        *hash_ptr = hash_bool(false);
+    }
+    else if (consume_token(context, TK_TRUE)) {
+        *hash_ptr = hash_bool(true);
+    }
+    else if (consume_token(context, TK_NULL)) {
+        *hash_ptr = hash_null();
+    }
+    else if (consume_number(context, &num)) {
+        *hash_ptr = hash_number(num);
+    }
+    else if (consume_string(context, &str)) {
+        *hash_ptr = hash_str(str);
+        free((char *)str);
+    }
+    else if (consume_token(context, TK_BEGIN_ARRAY)) {
+        if (context->depth++ >= MAX_NESTING_DEPTH) {
+            set_error(JE_TOO_DEEP, pos);
+            return false;
+        }
+        uint64_t hash = HASH_TAG_ARRAY;
+        if (!consume_token(context, TK_END_ARRAY)) {
+            do {
+                uint64_t element_hash;
+                if (!hash_value(context, &element_hash))
+                    return false;
+                hash = hash_element(hash, element_hash);
+            } while (consume_token(context, TK_VALUE_SEP));
+            if (!expect_token(context, TK_END_ARRAY))
+                return false;
+        }
+        *hash_ptr = mix64(hash);
+        context->depth--;
+    }
+    else if (consume_token(context, TK_BEGIN_OBJECT)) {
+        if (context->depth++ >= MAX_NESTING_DEPTH) {
+            set_error(JE_TOO_DEEP, pos);
+            return false;
+        }
+        uint64_t hash = 0;
+        if (!consume_token(context, TK_END_OBJECT)) {
+            do {
+                const char *key;
+                uint64_t value_hash;
+                if (!expect_string(context, &key))
+                    return false;
+                if (!expect_token(context, TK_NAME_SEP) || !hash_value(context, &value_hash)) {
+                    free((char *)key);
+                    return false;
+                }
+                hash = hash_member(hash, key, value_hash);
+                free((char *)key);
+            } while (consume_token(context, TK_VALUE_SEP));
+            if (!expect_token(context, TK_END_OBJECT))
+                return false;
+        }
+        *hash_ptr = mix64(HASH_TAG_OBJECT ^ hash);
+        context->depth--;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Hashes a document without building its tree. The result is the hash the
+// root of parse(code) would have.
+bool hash_text(const char *code, uint64_t *hash_ptr)
+{
+    StructuralIndex *index = build_index(code);
+    if (!index)
+        return false;
+
+    Context context;
+    context.depth = 0;
+    context.code = code;
+    context.index = index;
+    context.position = 0;
+    load_token(&context);
+
+    if (!hash_value(&context, hash_ptr)) {
+        set_error(at_eof(&context) ? JE_UNEXPECTED_EOF : JE_UNEXPECTED_TOKEN, context.token.pos);
+        ERROR_FLAGS |= PARSE_ERROR;
+    }
+    else if (!at_eof(&context)) {
+        set_error(JE_TRAILING_DATA, context.token.pos);
+        ERROR_FLAGS |= PARSE_ERROR;
+    }
+    if (context.token.kind == TK_STR)
+        free((char *)context.token.str);
+    free_index(index);
+    locate_error(code, NULL);
+    return !ERROR_FLAGS;
+}
+
+static int compare_member_keys(const void *a, const void *b)
+{
+    const JSONMember *x = *(const JSONMember **)a;
+    const JSONMember *y = *(const JSONMember **)b;
+    int result = strcmp(x->key, y->key);
+    if (result)
+        return result;
+    return x->value->hash < y->value->hash ? -1 : x->value->hash > y->value->hash;
+}
+
+static size_t count_members(const JSONMember *members)
+{
+    size_t count = 0;
+    for (; members; members = members->next)
+        count++;
+    return count;
+}
+
+static JSONMember **sorted_members(const JSONValue *value, size_t count,
+                                   int (*compare)(const void *, const void *))
+{
+    JSONMember **members = malloc(sizeof(JSONMember *) * (count ? count : 1));
+    if (!members) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    size_t i = 0;
+    for (JSONMember *current = value->members; current; current = current->next)
+        members[i++] = current;
+    qsort(members, count, sizeof(JSONMember *), compare);
+    return members;
+}
+
+static bool equal_members(const JSONValue *a, const JSONValue *b)
+{
+    size_t count = count_members(a->members);
+    if (count != count_members(b->members))
+        return false;
+
+    // Small objects: match every member of a with an unused one of b.
+    if (EQUAL_SMALL_OBJECT >= count) {
+        bool used[EQUAL_SMALL_OBJECT] = { false };
+        for (const JSONMember *x = a->members; x; x = x->next) {
+            size_t i = 0;
+            const JSONMember *y = b->members;
+            for (; y; y = y->next, i++)
+                if (!used[i] && !strcmp(x->key, y->key) && equal_json(x->value, y->value))
+                    break;
+            if (!y)
+                return false;
+            used[i] = true;
+        }
+        return true;
+    }
+
+    // Large objects: sort both by key and value hash and compare in order.
+    JSONMember **x = sorted_members(a, count, compare_member_keys);
+    JSONMember **y = sorted_members(b, count, compare_member_keys);
+    bool equal = x && y;
+    for (size_t i = 0; equal && count > i; i++)
+        equal = !strcmp(x[i]->key, y[i]->key) && equal_json(x[i]->value, y[i]->value);
+    free(x);
+    free(y);
+    return equal;
+}
+
+bool equal_json(const JSONValue *a, const JSONValue *b)
+{
+    if (a == b)
+        return true;
+    if (!a || !b || a->type != b->type || a->hash != b->hash)
+        return false;
+
+    switch (a->type) {
+        case JV_BOOL:
+            return a->value == b->value;
+        case JV_NULL:
+            return true;
+        case JV_NUM:
+            return (double)a->num == (double)b->num || (isnan(a->num) && isnan(b->num));
+        case JV_STR:
+            return !strcmp(a->str, b->str);
+        case JV_ARRAY: {
+            const JSONValue *x = a->elements, *y = b->elements;
+            for (; x && y; x = x->next, y = y->next)
+                if (!equal_json(x, y))
+                    return false;
+            return !x && !y;
+        }
+        case JV_OBJECT:
+            return equal_members(a, b);
+    }
+    return false;
+}
+
+// ========== RFC 8785 ==========
+
+typedef struct UTF16Iterator UTF16Iterator;
+struct UTF16Iterator {
+    const unsigned char *current;
+    unsigned int low_surrogate; // 0でなければ次に返す
+};
+
+// Returns the next UTF-16 code unit of a UTF-8 string, -1 at the end.
+// U+0000 is stored as C0 80 and comes out as the code unit 0.
+// Malformed sequences are passed through byte by byte.
+static long next_utf16(UTF16Iterator *it)
+{
+    if (it->low_surrogate) {
+        long unit = it->low_surrogate;
+        it->low_surrogate = 0;
+        return unit;
+    }
+
+    const unsigned char *p = it->current;
+    unsigned int c = *p;
+    if (!c)
+        return -1;
+    unsigned int length = c >= 0xF0 && c < 0xF8 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    if (length > 1) {
+        unsigned int code_point = c & (0x7F >> length);
+        for (unsigned int i = 1; length > i; i++) {
+            if ((p[i] & 0xC0) != 0x80) {
+                length = 1;
+                break;
+            }
+            code_point = code_point << 6 | (p[i] & 0x3F);
+        }
+        if (length > 1)
+            c = code_point;
+    }
+    it->current += length;
+
+    if (c >= 0x10000) {
+        c -= 0x10000;
+        it->low_surrogate = 0xDC00 | (c & 0x3FF);
+        return 0xD800 | (c >> 10);
+    }
+    return c;
+}
+
+static int compare_utf16(const char *a, const char *b)
+{
+    UTF16Iterator x = { (const unsigned char *)a, 0 };
+    UTF16Iterator y = { (const unsigned char *)b, 0 };
+    while (true) {
+        long u = next_utf16(&x);
+        long v = next_utf16(&y);
+        if (u != v)
+            return u < v ? -1 : 1;
+        if (u < 0)
+            return 0;
+    }
+}
+
+static int compare_canonical_keys(const void *a, const void *b)
+{
+    const JSONMember *x = *(const JSONMember **)a;
+    const JSONMember *y = *(const JSONMember **)b;
+    return compare_utf16(x->key, y->key);
+}
+
+static bool append_str(StringBuilder *sb, const char *str)
+{
+    for (; *str; str++)
+        if (!append_sb(sb, *str))
+            return false;
+    return true;
+}
+
+static bool canonicalize_string(StringBuilder *sb, const char *str)
+{
+    char buf[8];
+    if (!append_sb(sb, '"'))
+        return false;
+    for (; *str; str++) {
+        unsigned char c = *str;
+        const char *escape = NULL;
+        switch (c) {
+            case '"':  escape = "\\\""; break;
+            case '\\': escape = "\\\\"; break;
+            case 0x08: escape = "\\b"; break;
+            case 0x09: escape = "\\t"; break;
+            case 0x0A: escape = "\\n"; break;
+            case 0x0C: escape = "\\f"; break;
+            case 0x0D: escape = "\\r"; break;
+            default:
+                if (c < 0x20) {
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    escape = buf;
+                }
+                else if (c == 0xC0 && (unsigned char)str[1] == 0x80) { // U+0000
+                    escape = "\\u0000";
+                    str++;
+                }
+                break;
+        }
+        if (escape ? !append_str(sb, escape) : !append_sb(sb, c))
+            return false;
+    }
+    return append_sb(sb, '"');
+}
+
+// ECMAScript Number.prototype.toString() of the nearest double.
+static bool canonicalize_number(StringBuilder *sb, long double num)
+{
+    double d = (double)num;
+    if (isnan(d) || isinf(d)) {
+        ERROR_FLAGS |= UNSUPPORTED_ERROR;
+        return false;
+    }
+    if (d == 0)
+        return append_sb(sb, '0');
+
+    char buf[DTOA_BUFFER_SIZE];
+    size_t length = format_double(buf, d);
+    for (size_t i = 0; length > i; i++)
+        if (!append_sb(sb, buf[i]))
+            return false;
+    return true;
+}
+
+static bool canonicalize_value(StringBuilder *sb, const JSONValue *value)
+{
+    switch (value->type) {
+        case JV_BOOL:
+            return append_str(sb, value->value ? "true" : "false");
+        case JV_NULL:
+            return append_str(sb, "null");
+        case JV_NUM:
+            return canonicalize_number(sb, value->num);
+        case JV_STR:
+            return canonicalize_string(sb, value->str);
+        case JV_ARRAY:
+            if (!append_sb(sb, '['))
+                return false;
+            for (const JSONValue *current = value->elements; current; current = current->next) {
+                if (current != value->elements && !append_sb(sb, ','))
+                    return false;
+                if (!canonicalize_value(sb, current))
+                    return false;
+            }
+            return append_sb(sb, ']');
+        case JV_OBJECT: {
+            size_t count = count_members(value->members);
+            JSONMember **members = sorted_members(value, count, compare_canonical_keys);
+            bool ok = members && append_sb(sb, '{');
+            for (size_t i = 0; ok && count > i; i++) {
+                if (i && !append_sb(sb, ','))
+                    ok = false;
+                else
+                    ok = canonicalize_string(sb, members[i]->key) && append_sb(sb, ':')
+                         && canonicalize_value(sb, members[i]->value);
+            }
+            free(members);
+            return ok && append_sb(sb, '}');
+        }
+    }
+    return false;
+}
+
+// Returns the canonical text of value, which the caller frees. Returns NULL
+// for numbers JCS cannot represent (NaN, Infinity) and when out of memory.
+char *canonicalize_json(const JSONValue *value)
+{
+    StringBuilder builder;
+    if (!initial_sb(&builder)) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    if (!canonicalize_value(&builder, value) || !get_str_sb(&builder)) {
+        if (!(ERROR_FLAGS & UNSUPPORTED_ERROR))
+            ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free(builder.str);
+        return NULL;
+    }
+    return builder.str;
+}
@@ -0,0 +1,204 @@
+#include "cjson.h"
+
+// Structural index: the offsets of all tokens of a buffer as uint32_t.
+//
+// build_index() runs the lexer once without allocating tokens or strings.
+// The index can then be used any number of times on the same buffer to
+// parse the whole document or a single value, or to skip values, without
+// lexing again.  It records the length of the buffer, and an index that
+// does not fit the buffer it is used with, e.g. one built on another
+// buffer or loaded from a file, is rejected with JE_INDEX_MISMATCH before
+// anything is read through its offsets.
+
+static bool push_offset(StructuralIndex *index, uint32_t offset)
+{
+    if (index->size >= index->capacity) {
+        // capacityはuint32_tなので倍にする前に溢れないか確かめる
+        if (index->capacity == UINT32_MAX) {
+            ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+            return false;
+        }
+        uint32_t capacity = index->capacity > UINT32_MAX / 2 ? UINT32_MAX : index->capacity * 2;
+        uint32_t *offsets = realloc(index->offsets, sizeof(uint32_t) * (size_t)capacity);
+        if (!offsets) {
+            ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+            return false;
+        }
+        index->offsets = offsets;
+        index->capacity = capacity;
+    }
+    index->offsets[index->size++] = offset;
+    return true;
+}
+
+StructuralIndex *build_index(const char *code)
+{
+    reset_error();
+
+    size_t length = strlen(code);
+    if (length > UINT32_MAX) {
+        ERROR_FLAGS |= UNSUPPORTED_ERROR;
+        return NULL;
+    }
+
+    StructuralIndex *index = malloc(sizeof(StructuralIndex));
+    if (!index) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    index->size = 0;
+    index->capacity = STRUCTURAL_INDEX_INITIAL_CAPACITY;
+    index->length = length;
+    if (!(index->offsets = malloc(sizeof(uint32_t) * index->capacity))) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free(index);
+        return NULL;
+    }
+
+    const char *current_char = code;
+    const char *end_char = code + length;
+    while ((current_char = skip_whitespace(current_char, end_char)) < end_char) {
+        if (!push_offset(index, current_char - code))
+            goto failed;
+        TokenKind kind;
+        if (!(current_char = scan_token(current_char, end_char, &kind)))
+            goto failed;
+    }
+    return index;
+
+failed:
+    ERROR_FLAGS |= TOKENIZE_ERROR;
+    locate_error(code, end_char);
+    free_index(index);
+    return NULL;
+}
+
+void free_index(StructuralIndex *index)
+{
+    if (!index)
+        return;
+    free(index->offsets);
+    free(index);
+}
+
+// Whether code has the length the index was built for. At most length + 1
+// bytes are read, so a shorter buffer is not overrun.
+static bool length_matches(const char *code, const StructuralIndex *index)
+{
+    const char *nul = memchr(code, '\0', (size_t)index->length + 1);
+    return nul && (size_t)(nul - code) == index->length;
+}
+
+// Whether index can be used with code: the lengths agree and every offset
+// is inside the buffer.
+bool index_matches(const char *code, const StructuralIndex *index)
+{
+    if (!length_matches(code, index))
+        return false;
+    for (uint32_t i = 0; index->size > i; i++)
+        if (index->offsets[i] >= index->length)
+            return false;
+    return true;
+}
+
+static void index_mismatch(const char *code)
+{
+    reset_error();
+    ERROR_FLAGS = PARSE_ERROR;
+    set_error(JE_INDEX_MISMATCH, NULL);
+    locate_error(code, NULL);
+}
+
+// Moves *position_ptr past the value starting there. Only the offsets it
+// reads are checked.
+static bool skip_value(const char *code, const StructuralIndex *index, uint32_t *position_ptr)
+{
+    uint32_t position = *position_ptr;
+    long depth = 0;
+    do {
+        if (index->offsets[position] >= index->length)
+            return false;
+        switch (code[index->offsets[position]]) {
+            case '[':
+            case '{':
+                depth++;
+                break;
+            case ']':
+            case '}':
+                depth--;
+                break;
+        }
+        position++;
+    } while (depth > 0 && index->size > position);
+    *position_ptr = position;
+    return true;
+}
+
+// Returns the position just after the value starting at position. If the
+// index does not fit code, the error is set and index->size is returned.
+uint32_t skip_indexed_value(const char *code, const StructuralIndex *index, uint32_t position)
+{
+    if (position >= index->size)
+        return position;
+    if (!length_matches(code, index) || !skip_value(code, index, &position)) {
+        index_mismatch(code);
+        return index->size;
+    }
+    return position;
+}
+
+// The offsets of index have been checked.
+static JSONValue *parse_checked(const char *code, const StructuralIndex *index)
+{
+    reset_error();
+
+    Context context;
+    context.depth = 0;
+    context.code = code;
+    context.index = index;
+    context.position = 0;
+    load_token(&context);
+
+    JSONValue *value = json_node(&context);
+    if (context.token.kind == TK_STR)
+        free((char *)context.token.str);
+    if (ERROR_FLAGS) {
+        locate_error(code, NULL);
+        free_json(value);
+        return NULL;
+    }
+    return value;
+}
+
+JSONValue *parse_indexed(const char *code, const StructuralIndex *index)
+{
+    if (!index_matches(code, index)) {
+        index_mismatch(code);
+        return NULL;
+    }
+    return parse_checked(code, index);
+}
+
+// Parses only the value starting at position, e.g. one found with
+// skip_indexed_value().
+JSONValue *parse_indexed_value(const char *code, const StructuralIndex *index, uint32_t position)
+{
+    if (position >= index->size) {
+        reset_error();
+        ERROR_FLAGS = PARSE_ERROR;
+        locate_error(code, NULL);
+        return NULL;
+    }
+
+    uint32_t end = position;
+    if (!length_matches(code, index) || !skip_value(code, index, &end)) {
+        index_mismatch(code);
+        return NULL;
+    }
+    StructuralIndex view;
+    view.offsets = index->offsets + position;
+    view.size = end - position;
+    view.capacity = view.size;
+    view.length = index->length;
+    return parse_checked(code, &view);
+}
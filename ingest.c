@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <threads.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "cjson.h"
+
+// File ingestion pipeline.
+//
+//   submit_ingest() -> pending -> read stage -> parsing -> parser threads
+//                   -> completed -> next_ingest()
+//
+// The read stage is one thread driving an io_uring with up to
+// INGEST_QUEUE_DEPTH reads in flight, or a pool of INGEST_READERS threads
+// doing blocking reads when io_uring is unavailable or INGEST_THREAD_POOL
+// is given.  A file's size is reserved against memory_limit before it is
+// read and released when its result is taken by next_ingest(), so buffers
+// and queued results stay bounded.  A single file larger than the limit is
+// still read once nothing else is reserved.  Only regular files can be
+// ingested; anything else, e.g. a FIFO, fails with the io_error EINVAL.
+
+typedef struct IngestJob IngestJob;
+struct IngestJob {
+    char *path;
+    void *user_data;
+
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t done;
+    size_t reserved;
+
+    JSONValue *value;
+    unsigned char error_flags;
+    JSONError error;
+    int io_error;
+
+    IngestJob *next;
+};
+
+typedef struct JobQueue JobQueue;
+struct JobQueue {
+    IngestJob *head;
+    IngestJob *tail;
+};
+
+#ifdef __linux__
+typedef struct Ring Ring;
+struct Ring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct Ingest {
+    mtx_t lock;
+    cnd_t changed;
+
+    JobQueue pending;
+    JobQueue parsing;
+    JobQueue completed;
+    size_t outstanding;
+    size_t memory_limit;
+    size_t memory_used;
+    bool closing;
+
+    thrd_t *threads;
+    unsigned int thread_count;
+
+    bool uring;
+#ifdef __linux__
+    Ring ring;
+#endif
+};
+
+static void push_job(JobQueue *queue, IngestJob *job)
+{
+    job->next = NULL;
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+}
+
+static IngestJob *pop_job(JobQueue *queue)
+{
+    IngestJob *job = queue->head;
+    if (!job)
+        return NULL;
+    queue->head = job->next;
+    if (!queue->head)
+        queue->tail = NULL;
+    return job;
+}
+
+static void free_job(IngestJob *job)
+{
+    if (job->fd >= 0)
+        close(job->fd);
+    free(job->path);
+    free(job->buffer);
+    free_json(job->value);
+    free(job);
+}
+
+static void free_jobs(JobQueue *queue)
+{
+    IngestJob *job;
+    while ((job = pop_job(queue)))
+        free_job(job);
+}
+
+// Called with the lock held.
+static void complete_job(Ingest *ingest, IngestJob *job)
+{
+    if (job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (job->io_error) {
+        free(job->buffer);
+        job->buffer = NULL;
+        push_job(&ingest->completed, job);
+    }
+    else {
+        job->buffer[job->done] = '\0';
+        push_job(&ingest->parsing, job);
+    }
+    cnd_broadcast(&ingest->changed);
+}
+
+// st_sizeが0でも中身があるか確かめる
+static bool has_contents(int fd)
+{
+    char c;
+    ssize_t n;
+    while ((n = pread(fd, &c, 1, 0)) < 0 && errno == EINTR)
+        ;
+    return n > 0;
+}
+
+// Opens the file and finds its size. Returns false when the job failed and
+// was completed already. Called with the lock held.
+// Only files with a known size can be reserved, so FIFOs, sockets and
+// devices fail with EINVAL, and so do files like those under /proc that
+// report a size of 0 but have contents. O_NONBLOCK keeps open() of a FIFO
+// from stalling the read stage.
+static bool open_job(Ingest *ingest, IngestJob *job)
+{
+    mtx_unlock(&ingest->lock);
+    struct stat st;
+    job->fd = open(job->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (job->fd < 0 || fstat(job->fd, &st))
+        job->io_error = errno;
+    else if (!S_ISREG(st.st_mode) || (!st.st_size && has_contents(job->fd)))
+        job->io_error = EINVAL;
+    else
+        job->size = st.st_size;
+    mtx_lock(&ingest->lock);
+
+    if (job->io_error) {
+        complete_job(ingest, job);
+        return false;
+    }
+    return true;
+}
+
+// Reserves the buffer of an opened job against the memory limit. Without
+// block it gives up instead of waiting. Called with the lock held.
+static bool reserve_job(Ingest *ingest, IngestJob *job, bool block)
+{
+    while (ingest->memory_used && ingest->memory_used + job->size + 1 > ingest->memory_limit
+           && !ingest->closing) {
+        if (!block)
+            return false;
+        cnd_wait(&ingest->changed, &ingest->lock);
+    }
+    job->reserved = job->size + 1;
+    ingest->memory_used += job->reserved;
+    return true;
+}
+
+// Allocates the buffer of a reserved job. Returns false when the job failed
+// and was completed already. Called with the lock held.
+static bool allocate_job(Ingest *ingest, IngestJob *job)
+{
+    if (!(job->buffer = malloc(job->reserved))) {
+        job->io_error = ENOMEM;
+        complete_job(ingest, job);
+        return false;
+    }
+    return true;
+}
+
+static int reader_thread(void *arg)
+{
+    Ingest *ingest = arg;
+    mtx_lock(&ingest->lock);
+    while (true) {
+        while (!ingest->pending.head && !ingest->closing)
+            cnd_wait(&ingest->changed, &ingest->lock);
+        if (ingest->closing)
+            break;
+
+        IngestJob *job = pop_job(&ingest->pending);
+        if (!open_job(ingest, job))
+            continue;
+        reserve_job(ingest, job, true);
+        if (!allocate_job(ingest, job))
+            continue;
+
+        mtx_unlock(&ingest->lock);
+        while (job->size > job->done) {
+            ssize_t n = pread(job->fd, job->buffer + job->done, job->size - job->done, job->done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                job->io_error = errno;
+            if (n <= 0)
+                break;
+            job->done += n;
+        }
+        mtx_lock(&ingest->lock);
+        complete_job(ingest, job);
+    }
+    mtx_unlock(&ingest->lock);
+    return 0;
+}
+
+#ifdef __linux__
+// IORING_OP_READ is newer than io_uring itself (5.6), as is the probe.
+static bool supports_read(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe)
+        return false;
+    bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) >= 0
+                     && probe->ops_len > IORING_OP_READ
+                     && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static bool setup_ring(Ring *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, INGEST_QUEUE_DEPTH, &params);
+    if (ring->fd < 0)
+        return false;
+    if (!supports_read(ring->fd)) {
+        close(ring->fd);
+        return false;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ptr != MAP_FAILED)
+            munmap(ring->sq_ptr, ring->sq_size);
+        if (ring->cq_ptr != MAP_FAILED)
+            munmap(ring->cq_ptr, ring->cq_size);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return false;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void close_ring(Ring *ring)
+{
+    munmap(ring->sq_ptr, ring->sq_size);
+    munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->fd);
+}
+
+// Puts a read of the rest of the job into the submission queue. It is handed
+// to the kernel by the next reap_reads(). Once published an SQE cannot be
+// taken back, so the job stays in flight until its completion arrives.
+static void queue_read(Ring *ring, IngestJob *job)
+{
+    size_t length = job->size - job->done;
+    if (length > INGEST_MAX_READ)
+        length = INGEST_MAX_READ; // sqe->lenは32ビット
+
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = job->fd;
+    sqe->addr = (uintptr_t)(job->buffer + job->done);
+    sqe->len = length;
+    sqe->off = job->done;
+    sqe->user_data = (uintptr_t)job;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submits the queued reads, waits for at least one completion and finishes
+// or requeues the reads. Returns the number of reads that left the ring.
+static unsigned int reap_reads(Ingest *ingest)
+{
+    Ring *ring = &ingest->ring;
+    unsigned int to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    int ret;
+    while ((ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0
+           && errno == EINTR)
+        ;
+
+    unsigned int finished = 0;
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        IngestJob *job = (IngestJob *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (res == -EINTR || res == -EAGAIN)
+            res = 0;
+        else if (res < 0)
+            job->io_error = -res;
+        else if (res == 0)
+            job->size = job->done;
+        job->done += res;
+
+        if (!job->io_error && job->size > job->done) {
+            queue_read(ring, job);
+            continue;
+        }
+
+        mtx_lock(&ingest->lock);
+        complete_job(ingest, job);
+        mtx_unlock(&ingest->lock);
+        finished++;
+    }
+
+    // EBUSYやEAGAINでは完了を刈り取ってからやり直す. 何も完了していなければ
+    // 少し待つ
+    if (ret < 0 && !finished)
+        thrd_sleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    return finished;
+}
+
+static int uring_thread(void *arg)
+{
+    Ingest *ingest = arg;
+    unsigned int inflight = 0;
+    IngestJob *waiting = NULL; // opened, but did not fit into the memory limit
+    mtx_lock(&ingest->lock);
+    while (true) {
+        while (!inflight && !waiting && !ingest->pending.head && !ingest->closing)
+            cnd_wait(&ingest->changed, &ingest->lock);
+        if (!inflight && ingest->closing)
+            break;
+
+        // Read ahead as far as the ring and the memory limit allow. Waiting
+        // for memory is only possible when no read is left to reap.
+        while (INGEST_QUEUE_DEPTH > inflight && !ingest->closing) {
+            IngestJob *job = waiting;
+            waiting = NULL;
+            if (!job) {
+                if (!(job = pop_job(&ingest->pending)))
+                    break;
+                if (!open_job(ingest, job))
+                    continue;
+            }
+            if (!reserve_job(ingest, job, !inflight)) {
+                waiting = job;
+                break;
+            }
+            if (!allocate_job(ingest, job))
+                continue;
+            if (job->size == 0) {
+                complete_job(ingest, job);
+                continue;
+            }
+            queue_read(&ingest->ring, job);
+            inflight++;
+        }
+
+        if (inflight) {
+            mtx_unlock(&ingest->lock);
+            inflight -= reap_reads(ingest);
+            mtx_lock(&ingest->lock);
+        }
+    }
+    mtx_unlock(&ingest->lock);
+    if (waiting)
+        free_job(waiting);
+    return 0;
+}
+#endif // __linux__
+
+static int parser_thread(void *arg)
+{
+    Ingest *ingest = arg;
+    mtx_lock(&ingest->lock);
+    while (true) {
+        while (!ingest->parsing.head && !ingest->closing)
+            cnd_wait(&ingest->changed, &ingest->lock);
+        if (ingest->closing)
+            break;
+
+        IngestJob *job = pop_job(&ingest->parsing);
+        mtx_unlock(&ingest->lock);
+        job->value = parse(job->buffer);
+        job->error_flags = ERROR_FLAGS;
+        job->error = ERROR_INFO;
+        free(job->buffer);
+        job->buffer = NULL;
+        mtx_lock(&ingest->lock);
+
+        push_job(&ingest->completed, job);
+        cnd_broadcast(&ingest->changed);
+    }
+    mtx_unlock(&ingest->lock);
+    return 0;
+}
+
+static bool start_thread(Ingest *ingest, thrd_start_t func)
+{
+    if (thrd_create(&ingest->threads[ingest->thread_count], func, ingest) != thrd_success)
+        return false;
+    ingest->thread_count++;
+    return true;
+}
+
+Ingest *new_ingest(unsigned int parsers, size_t memory_limit, unsigned int flags)
+{
+    if (!parsers)
+        parsers = 1;
+
+    Ingest *ingest = calloc(1, sizeof(Ingest));
+    if (!ingest) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    ingest->memory_limit = memory_limit;
+    if (!(ingest->threads = malloc(sizeof(thrd_t) * (parsers + INGEST_READERS)))) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free(ingest);
+        return NULL;
+    }
+    mtx_init(&ingest->lock, mtx_plain);
+    cnd_init(&ingest->changed);
+
+#ifdef __linux__
+    if (!(flags & INGEST_THREAD_POOL) && setup_ring(&ingest->ring)) {
+        ingest->uring = true;
+        if (!start_thread(ingest, uring_thread))
+            goto failed;
+    }
+#endif
+    if (!ingest->uring)
+        for (unsigned int i = 0; INGEST_READERS > i; i++)
+            if (!start_thread(ingest, reader_thread))
+                goto failed;
+    for (unsigned int i = 0; parsers > i; i++)
+        if (!start_thread(ingest, parser_thread))
+            goto failed;
+    return ingest;
+
+failed:
+    ERROR_FLAGS |= UNSUPPORTED_ERROR;
+    free_ingest(ingest);
+    return NULL;
+}
+
+bool submit_ingest(Ingest *ingest, const char *path, void *user_data)
+{
+    IngestJob *job = calloc(1, sizeof(IngestJob));
+    size_t length = strlen(path);
+    if (!job || !(job->path = malloc(length + 1))) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free(job);
+        return false;
+    }
+    memcpy(job->path, path, length + 1);
+    job->user_data = user_data;
+    job->fd = -1;
+
+    mtx_lock(&ingest->lock);
+    push_job(&ingest->pending, job);
+    ingest->outstanding++;
+    cnd_broadcast(&ingest->changed);
+    mtx_unlock(&ingest->lock);
+    return true;
+}
+
+// Blocks until a submitted file is done. Returns false when nothing is left.
+bool next_ingest(Ingest *ingest, IngestResult *result)
+{
+    mtx_lock(&ingest->lock);
+    while (!ingest->completed.head && ingest->outstanding)
+        cnd_wait(&ingest->changed, &ingest->lock);
+    IngestJob *job = pop_job(&ingest->completed);
+    if (job) {
+        ingest->outstanding--;
+        ingest->memory_used -= job->reserved;
+        cnd_broadcast(&ingest->changed);
+    }
+    mtx_unlock(&ingest->lock);
+    if (!job)
+        return false;
+
+    result->user_data = job->user_data;
+    result->value = job->value;
+    result->error_flags = job->error_flags;
+    result->error = job->error;
+    result->io_error = job->io_error;
+    job->value = NULL;
+    free_job(job);
+    return true;
+}
+
+void free_ingest(Ingest *ingest)
+{
+    mtx_lock(&ingest->lock);
+    ingest->closing = true;
+    cnd_broadcast(&ingest->changed);
+    mtx_unlock(&ingest->lock);
+
+    for (unsigned int i = 0; ingest->thread_count > i; i++)
+        thrd_join(ingest->threads[i], NULL);
+#ifdef __linux__
+    if (ingest->uring)
+        close_ring(&ingest->ring);
+#endif
+
+    free_jobs(&ingest->pending);
+    free_jobs(&ingest->parsing);
+    free_jobs(&ingest->completed);
+    cnd_destroy(&ingest->changed);
+    mtx_destroy(&ingest->lock);
+    free(ingest->threads);
+    free(ingest);
+}
@@ -1,15 +1,42 @@
 #include "cjson.h"
 
-#define IF_STRING_MATCH_THEN_CREATE_TOKEN(kind, str) \
-{ \
-    unsigned int len = strlen(str); \
-    if (!strncmp(current_char, str, len)) { \
-        if (!(head = insert_token(head, kind, current_char, len))) \
-            goto failed; \
-        current_char += len; \
-        continue; \
-    } \
-} \
+// 先頭の1バイトでトークンの種類が決まる
+typedef enum CharClass CharClass;
+enum CharClass {
+    CC_INVALID,
+    CC_WHITESPACE,
+    CC_FALSE,
+    CC_TRUE,
+    CC_NULL,
+    CC_NUMBER,
+    CC_STRING,
+    CC_BEGIN_ARRAY,
+    CC_VALUE_SEP,
+    CC_END_ARRAY,
+    CC_BEGIN_OBJECT,
+    CC_NAME_SEP,
+    CC_END_OBJECT,
+};
+
+static const unsigned char CHAR_CLASS[256] = {
+    [' '] = CC_WHITESPACE, ['\t'] = CC_WHITESPACE, ['\n'] = CC_WHITESPACE, ['\r'] = CC_WHITESPACE,
+    ['f'] = CC_FALSE, ['t'] = CC_TRUE, ['n'] = CC_NULL,
+    ['-'] = CC_NUMBER,
+    ['0'] = CC_NUMBER, ['1'] = CC_NUMBER, ['2'] = CC_NUMBER, ['3'] = CC_NUMBER, ['4'] = CC_NUMBER,
+    ['5'] = CC_NUMBER, ['6'] = CC_NUMBER, ['7'] = CC_NUMBER, ['8'] = CC_NUMBER, ['9'] = CC_NUMBER,
+    ['"'] = CC_STRING,
+    ['['] = CC_BEGIN_ARRAY, [','] = CC_VALUE_SEP, [']'] = CC_END_ARRAY,
+    ['{'] = CC_BEGIN_OBJECT, [':'] = CC_NAME_SEP, ['}'] = CC_END_OBJECT,
+};
+
+// Compares 4 bytes at once. The caller checks that they are in range.
+static bool match_word(const char *current_char, const char *word)
+{
+    uint32_t a, b;
+    memcpy(&a, current_char, 4);
+    memcpy(&b, word, 4);
+    return a == b;
+}
 
 static const char *get_nullchar_ptr(const char *str)
 {
@@ -27,6 +54,7 @@ static Token *insert_token(Token *head, TokenKind kind, const char *str, int str
     }
 
     new_token->kind = kind;
+    new_token->pos = str;
     new_token->str = str;
     new_token->str_length = str_length;
     new_token->next = NULL;
@@ -35,10 +63,187 @@ static Token *insert_token(Token *head, TokenKind kind, const char *str, int str
     return new_token;
 }
 
-static const char *tokenize_string(const char *current_char, const char **next_ptr)
+static bool at_end(const char *current_char, const char *end_char)
+{
+    return current_char == end_char || *current_char == '\0';
+}
+
+const char *skip_whitespace(const char *current_char, const char *end_char)
+{
+    while (end_char > current_char && CHAR_CLASS[(unsigned char)*current_char] == CC_WHITESPACE)
+        current_char++;
+    return current_char;
+}
+
+// number = [ minus ] int [ frac ] [ exp ]
+const char *scan_number(const char *current_char, const char *end_char)
+{
+    const char *begin = current_char;
+    if (!at_end(current_char, end_char) && *current_char == '-')
+        current_char++;
+
+    if (at_end(current_char, end_char) || !isdigit((unsigned char)*current_char))
+        goto failed;
+    if (*current_char++ == '0') {
+        if (!at_end(current_char, end_char) && isdigit((unsigned char)*current_char))
+            goto failed;
+    }
+    else {
+        while (!at_end(current_char, end_char) && isdigit((unsigned char)*current_char))
+            current_char++;
+    }
+
+    if (!at_end(current_char, end_char) && *current_char == '.') {
+        current_char++;
+        if (at_end(current_char, end_char) || !isdigit((unsigned char)*current_char))
+            goto failed;
+        while (!at_end(current_char, end_char) && isdigit((unsigned char)*current_char))
+            current_char++;
+    }
+
+    if (!at_end(current_char, end_char) && (*current_char == 'e' || *current_char == 'E')) {
+        current_char++;
+        if (!at_end(current_char, end_char) && (*current_char == '+' || *current_char == '-'))
+            current_char++;
+        if (at_end(current_char, end_char) || !isdigit((unsigned char)*current_char))
+            goto failed;
+        while (!at_end(current_char, end_char) && isdigit((unsigned char)*current_char))
+            current_char++;
+    }
+    return current_char;
+
+failed:
+    set_error(JE_INVALID_NUMBER, begin);
+    return NULL;
+}
+
+// Reads the 4 hex digits of a \\u escape. Returns -1 if they are not there.
+static long read_hex4(const char *current_char, const char *end_char)
+{
+    long code = 0;
+    for (int i = 0; 4 > i; i++, current_char++) {
+        if (at_end(current_char, end_char) || !isxdigit((unsigned char)*current_char))
+            return -1;
+        char c = *current_char;
+        code = code * 16 + (isdigit((unsigned char)c) ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return code;
+}
+
+// Checks a string token without decoding it.
+const char *scan_string(const char *current_char, const char *end_char)
+{
+    const char *begin = current_char;
+    current_char++;
+    while (true) {
+        if (at_end(current_char, end_char)) {
+            set_error(JE_UNTERMINATED_STRING, begin);
+            return NULL;
+        }
+        if (*current_char == '"')
+            break;
+        if ((unsigned char)*current_char < 0x20) {
+            set_error(JE_UNESCAPED_CONTROL, current_char);
+            return NULL;
+        }
+        if (*current_char == '\\') {
+            current_char++;
+            if (!at_end(current_char, end_char) && *current_char == 'u') {
+                if (read_hex4(current_char + 1, end_char) < 0) {
+                    set_error(JE_INVALID_ESCAPE, current_char - 1);
+                    return NULL;
+                }
+                current_char += 4;
+            }
+            else if (at_end(current_char, end_char) || !strchr("\"\\/bfnrt", *current_char)) {
+                set_error(JE_INVALID_ESCAPE, current_char - 1);
+                return NULL;
+            }
+        }
+        current_char++;
+    }
+    return current_char + 1;
+}
+
+// Scans the token starting at current_char without allocating anything.
+// Returns the end of the token, or NULL with the error set.
+const char *scan_token(const char *current_char, const char *end_char, TokenKind *kind_ptr)
+{
+    switch (CHAR_CLASS[(unsigned char)*current_char]) {
+        case CC_FALSE:
+            if (end_char - current_char >= 5 && match_word(current_char + 1, "alse")) {
+                *kind_ptr = TK_FALSE;
+                return current_char + 5;
+            }
+            break;
+        case CC_TRUE:
+            if (end_char - current_char >= 4 && match_word(current_char, "true")) {
+                *kind_ptr = TK_TRUE;
+                return current_char + 4;
+            }
+            break;
+        case CC_NULL:
+            if (end_char - current_char >= 4 && match_word(current_char, "null")) {
+                *kind_ptr = TK_NULL;
+                return current_char + 4;
+            }
+            break;
+        case CC_NUMBER:
+            *kind_ptr = TK_NUM;
+            return scan_number(current_char, end_char);
+        case CC_STRING:
+            *kind_ptr = TK_STR;
+            return scan_string(current_char, end_char);
+        case CC_BEGIN_ARRAY:
+            *kind_ptr = TK_BEGIN_ARRAY;
+            return current_char + 1;
+        case CC_VALUE_SEP:
+            *kind_ptr = TK_VALUE_SEP;
+            return current_char + 1;
+        case CC_END_ARRAY:
+            *kind_ptr = TK_END_ARRAY;
+            return current_char + 1;
+        case CC_BEGIN_OBJECT:
+            *kind_ptr = TK_BEGIN_OBJECT;
+            return current_char + 1;
+        case CC_NAME_SEP:
+            *kind_ptr = TK_NAME_SEP;
+            return current_char + 1;
+        case CC_END_OBJECT:
+            *kind_ptr = TK_END_OBJECT;
+            return current_char + 1;
+    }
+
+    set_error(JE_UNEXPECTED_CHAR, current_char);
+    return NULL;
+}
+
+// Appends code point code as UTF-8. Unpaired surrogates become U+FFFD, and
+// U+0000 is written as C0 80 (Modified UTF-8) so that it does not end the
+// string.
+static bool append_utf8(StringBuilder *sb, long code)
+{
+    if (0xD800 <= code && code < 0xE000)
+        code = 0xFFFD;
+    if (code == 0)
+        return append_sb(sb, (char)0xC0) && append_sb(sb, (char)0x80);
+    if (code < 0x80)
+        return append_sb(sb, code);
+    if (code < 0x800)
+        return append_sb(sb, 0xC0 | code >> 6) && append_sb(sb, 0x80 | (code & 0x3F));
+    if (code < 0x10000)
+        return append_sb(sb, 0xE0 | code >> 12) && append_sb(sb, 0x80 | (code >> 6 & 0x3F))
+               && append_sb(sb, 0x80 | (code & 0x3F));
+    return append_sb(sb, 0xF0 | code >> 18) && append_sb(sb, 0x80 | (code >> 12 & 0x3F))
+           && append_sb(sb, 0x80 | (code >> 6 & 0x3F)) && append_sb(sb, 0x80 | (code & 0x3F));
+}
+
+// Decodes a string token. end_char may be NULL for NUL terminated input.
+const char *tokenize_string(const char *current_char, const char *end_char, const char **next_ptr)
 {
     if (*current_char != '"')
         return NULL;
+    const char *begin = current_char;
     current_char++;
 
     StringBuilder builder;
@@ -48,11 +253,19 @@ static const char *tokenize_string(const char *current_char, const char **next_p
     }
 
     char c;
-    while (*current_char != '"') {
-        if (*current_char == '\0')
-            return NULL;
+    while (true) {
+        if (at_end(current_char, end_char)) {
+            set_error(JE_UNTERMINATED_STRING, begin);
+            goto failed;
+        }
+        if (*current_char == '"')
+            break;
         if (*current_char == '\\') {
             current_char++;
+            if (at_end(current_char, end_char)) {
+                set_error(JE_UNTERMINATED_STRING, begin);
+                goto failed;
+            }
             if (*current_char == '"') {
                 c = 0x22;
                 goto update;
@@ -86,17 +299,40 @@ static const char *tokenize_string(const char *current_char, const char **next_p
                 goto update;
             }
             if (*current_char == 'u') {
-                // TODO: あとでワイド文字に対応させる
-                ERROR_FLAGS |= UNSUPPORTED_ERROR;
-                return NULL;
+                const char *escape = current_char - 1;
+                long code = read_hex4(current_char + 1, end_char);
+                if (code < 0) {
+                    set_error(JE_INVALID_ESCAPE, escape);
+                    goto failed;
+                }
+                current_char += 4;
+                if (0xD800 <= code && code < 0xDC00 && !at_end(current_char + 1, end_char)
+                    && current_char[1] == '\\' && !at_end(current_char + 2, end_char) && current_char[2] == 'u') {
+                    long low = read_hex4(current_char + 3, end_char);
+                    if (0xDC00 <= low && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        current_char += 6;
+                    }
+                }
+                if (!append_utf8(&builder, code)) {
+                    ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+                    goto failed;
+                }
+                current_char++;
+                continue;
             }
-            return NULL;
+            set_error(JE_INVALID_ESCAPE, current_char - 1);
+            goto failed;
+        }
+        if ((unsigned char)*current_char < 0x20) {
+            set_error(JE_UNESCAPED_CONTROL, current_char);
+            goto failed;
         }
         c = *current_char;
 update:
         if (!append_sb(&builder, c)) {
             ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
-            return NULL;
+            goto failed;
         }
         current_char++;
     }
@@ -105,62 +341,58 @@ update:
     const char *str = get_str_sb(&builder);
     if (!str) {
         ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
-        return NULL;
+        goto failed;
     }
     return str;
+
+failed:
+    free(builder.str);
+    return NULL;
 }
 
 Token *tokenize(const char *code)
+{
+    return tokenize_range(code, get_nullchar_ptr(code));
+}
+
+// [code, end_char)だけを字句解析する. トークンはend_charを跨いではならない.
+Token *tokenize_range(const char *code, const char *end_char)
 {
     Token dummy;
     dummy.next = NULL;
 
     Token *head = &dummy;
     const char *current_char = code;
-    const char *end_char = get_nullchar_ptr(code);
-
-    while (end_char > current_char) {
-        if (strchr("\x20\x09\x0A\x0D", *current_char)) {
-            current_char++;
-            continue;
-        }
 
+    while ((current_char = skip_whitespace(current_char, end_char)) < end_char) {
 // printf("%p %c\n", current_char, *current_char);
 
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_FALSE, "false");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_TRUE, "true");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_NULL, "null");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_BEGIN_ARRAY, "[");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_END_ARRAY, "]");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_VALUE_SEP, ",");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_BEGIN_OBJECT, "{");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_NAME_SEP, ":");
-        IF_STRING_MATCH_THEN_CREATE_TOKEN(TK_END_OBJECT, "}");
-
-        // Number
-        if (*current_char == '-' || isdigit(*current_char)) {
-            if (!(head = insert_token(head, TK_NUM, current_char, 0)))
-                goto failed;
-            char *old_char = (char*)current_char;
-            head->num = strtold(current_char, (char **)&current_char);
-            if (old_char == current_char)
-                goto failed;
-            continue;
-        }
-
         // String
         if (*current_char == '"') {
+            const char *begin = current_char;
             const char *str;
-            if (!(str = tokenize_string(current_char, &current_char)))
+            if (!(str = tokenize_string(current_char, end_char, &current_char)))
                 goto failed;
-            if (!(head = insert_token(head, TK_STR, current_char, 0)))
+            if (!(head = insert_token(head, TK_STR, begin, 0))) {
+                free((char *)str);
                 goto failed;
+            }
             head->str = str;
             head->str_length = strlen(str);
             continue;
         }
 
-        goto failed;
+        TokenKind kind;
+        const char *next_char = scan_token(current_char, end_char, &kind);
+        if (!next_char)
+            goto failed;
+        if (!(head = insert_token(head, kind, current_char, next_char - current_char)))
+            goto failed;
+        if (kind == TK_NUM) {
+            head->num = strtold(current_char, NULL);
+            head->str_length = 0;
+        }
+        current_char = next_char;
     }
 
 // printf("%p %c\n", current_char, *current_char);
@@ -175,9 +407,15 @@ failed:
     return NULL;
 }
 
+// 文字列トークンはデコード済みの文字列を所有している.
+// consume_string()で取り出された場合は所有権がノードに移る.
 void free_tokens(Token *tokens)
 {
-    if (tokens && tokens->next)
-        free_tokens(tokens->next);
-    free(tokens);
+    while (tokens) {
+        Token *next = tokens->next;
+        if (tokens->kind == TK_STR)
+            free((char *)tokens->str);
+        free(tokens);
+        tokens = next;
+    }
 }
@@ -0,0 +1,362 @@
+#include "cjson.h"
+
+// Deep merge and JSON Merge Patch (RFC 7396).
+//
+// Both trees are consumed: members of the patch are moved into the target
+// instead of being copied, and whatever is replaced is freed.  Members of
+// objects larger than MERGE_SMALL_OBJECT, or growing past it while merging,
+// are looked up through a temporary hash table, so merging m members into an
+// object of n members is O(n + m) instead of O(n * m).  Removed members are
+// only marked while merging and unlinked in one pass at the end.  Hashes of
+// all changed nodes are updated.
+//
+// merge_patch_text() applies patch text without building the patch tree;
+// only the values that end up in the target are parsed into nodes.
+
+typedef struct MemberTable MemberTable;
+struct MemberTable {
+    JSONValue *object;
+    JSONMember **slots; // NULLなら線形探索
+    size_t capacity;    // 2の冪
+    size_t size;        // slotsがNULLの間はメンバの数
+};
+
+static size_t count_members(const JSONMember *members)
+{
+    size_t count = 0;
+    for (; members; members = members->next)
+        count++;
+    return count;
+}
+
+static void insert_member(MemberTable *table, JSONMember *member);
+
+// Indexes the members of the object with room for count of them. If the
+// table cannot be allocated the lookup stays a linear search.
+static void build_table(MemberTable *table, size_t count)
+{
+    for (table->capacity = MERGE_SMALL_OBJECT * 2; count * 2 > table->capacity; table->capacity *= 2)
+        ;
+    table->size = 0;
+    if (!(table->slots = calloc(table->capacity, sizeof(JSONMember *))))
+        return;
+    for (JSONMember *current = table->object->members; current; current = current->next)
+        insert_member(table, current);
+}
+
+// The table is built right away if object has, or is going to have, more
+// than MERGE_SMALL_OBJECT members, and otherwise by insert_member() once it
+// gets there.
+static void initial_table(MemberTable *table, JSONValue *object, size_t expected)
+{
+    table->object = object;
+    table->slots = NULL;
+    table->size = count_members(object->members);
+    if (table->size + expected > MERGE_SMALL_OBJECT)
+        build_table(table, table->size + expected);
+}
+
+static JSONMember *find_member(MemberTable *table, const char *key)
+{
+    if (!table->slots) {
+        for (JSONMember *current = table->object->members; current; current = current->next)
+            if (!strcmp(current->key, key))
+                return current;
+        return NULL;
+    }
+
+    size_t i = hash_bytes(key) & (table->capacity - 1);
+    for (; table->slots[i]; i = (i + 1) & (table->capacity - 1))
+        if (!strcmp(table->slots[i]->key, key))
+            return table->slots[i];
+    return NULL;
+}
+
+// member must already be linked into the object.
+// 重複したキーは最初のメンバだけを登録する
+static void insert_member(MemberTable *table, JSONMember *member)
+{
+    if (!table->slots) {
+        if (++table->size > MERGE_SMALL_OBJECT)
+            build_table(table, table->size);
+        return;
+    }
+
+    if ((table->size + 1) * 2 > table->capacity) {
+        JSONMember **old_slots = table->slots;
+        size_t old_capacity = table->capacity;
+        if (!(table->slots = calloc(old_capacity * 2, sizeof(JSONMember *)))) {
+            table->slots = old_slots;
+            return;
+        }
+        table->capacity = old_capacity * 2;
+        table->size = 0;
+        for (size_t i = 0; old_capacity > i; i++)
+            if (old_slots[i])
+                insert_member(table, old_slots[i]);
+        free(old_slots);
+    }
+
+    size_t i = hash_bytes(member->key) & (table->capacity - 1);
+    for (; table->slots[i]; i = (i + 1) & (table->capacity - 1))
+        if (!strcmp(table->slots[i]->key, member->key))
+            return;
+    table->slots[i] = member;
+    table->size++;
+}
+
+static void free_member(JSONMember *member)
+{
+    free((char *)member->key);
+    free_json(member->value);
+    free(member);
+}
+
+// Unlinks the members whose value was removed.
+static void remove_members(JSONValue *object)
+{
+    JSONMember **link = &object->members;
+    while (*link) {
+        JSONMember *current = *link;
+        if (current->value) {
+            link = &current->next;
+            continue;
+        }
+        *link = current->next;
+        free_member(current);
+    }
+}
+
+static JSONMember **tail_link(JSONValue *object)
+{
+    JSONMember **link = &object->members;
+    while (*link)
+        link = &(*link)->next;
+    return link;
+}
+
+// MergePatch({}, patch): null members are dropped at every level of
+// objects. Arrays are values and are left alone.
+static void strip_nulls(JSONValue *patch)
+{
+    bool removed = false;
+    for (JSONMember *current = patch->members; current; current = current->next) {
+        if (current->value->type == JV_NULL) {
+            free_json(current->value);
+            current->value = NULL;
+            removed = true;
+        }
+        else if (current->value->type == JV_OBJECT) {
+            strip_nulls(current->value);
+        }
+    }
+    if (removed)
+        remove_members(patch);
+    update_hash(patch);
+}
+
+static JSONValue *merge_value(JSONValue *target, JSONValue *patch, bool delete_nulls)
+{
+    if (patch->type != JV_OBJECT || !target || target->type != JV_OBJECT) {
+        free_json(target);
+        if (delete_nulls && patch->type == JV_OBJECT)
+            strip_nulls(patch);
+        return patch;
+    }
+
+    MemberTable table;
+    initial_table(&table, target, count_members(patch->members));
+    JSONMember **tail = tail_link(target);
+    bool removed = false;
+
+    JSONMember *next;
+    for (JSONMember *member = patch->members; member; member = next) {
+        next = member->next;
+        JSONMember *found = find_member(&table, member->key);
+
+        if (delete_nulls && member->value->type == JV_NULL) {
+            if (found && found->value) {
+                free_json(found->value);
+                found->value = NULL;
+                removed = true;
+            }
+            free_member(member);
+        }
+        else if (found) {
+            // 削除済みのメンバ(found->valueがNULL)もここで復活する
+            found->value = merge_value(found->value, member->value, delete_nulls);
+            member->value = NULL;
+            free_member(member);
+        }
+        else {
+            // メンバごと移す
+            member->value = merge_value(NULL, member->value, delete_nulls);
+            member->next = NULL;
+            *tail = member;
+            tail = &member->next;
+            insert_member(&table, member);
+        }
+    }
+    patch->members = NULL;
+    free_json(patch);
+    free(table.slots);
+
+    if (removed)
+        remove_members(target);
+    update_hash(target);
+    return target;
+}
+
+// Applies an RFC 7396 merge patch and returns the result. Both target and
+// patch are consumed; target may be NULL. A NULL patch, e.g. from a failed
+// parse(), gives NULL.
+JSONValue *merge_patch(JSONValue *target, JSONValue *patch)
+{
+    if (!patch) {
+        free_json(target);
+        return NULL;
+    }
+    return merge_value(target, patch, true);
+}
+
+// Like merge_patch(), but null in overlay is kept as a value instead of
+// removing the member. For layering defaults, environment and overrides.
+JSONValue *merge_json(JSONValue *base, JSONValue *overlay)
+{
+    if (!overlay) {
+        free_json(base);
+        return NULL;
+    }
+    return merge_value(base, overlay, false);
+}
+
+// merge_value() reading the patch from context, which has been validated,
+// so only running out of memory can fail. *target_ptr is replaced only on
+// success; after a failure it is still a valid tree, possibly with part of
+// the patch applied.
+static bool patch_value(Context *context, JSONValue **target_ptr)
+{
+    JSONValue *target = *target_ptr;
+    if (!consume_token(context, TK_BEGIN_OBJECT)) {
+        JSONValue *value = value_node(context);
+        if (!value)
+            return false;
+        free_json(target);
+        *target_ptr = value;
+        return true;
+    }
+
+    // オブジェクトでなければ新しいオブジェクトに適用し, 成功してから置き換える
+    JSONValue *object = target;
+    if (!target || target->type != JV_OBJECT) {
+        if (!(object = new_node(JV_OBJECT)))
+            return false;
+        object->members = NULL;
+    }
+
+    MemberTable table;
+    initial_table(&table, object, 0);
+    JSONMember **tail = tail_link(object);
+    bool removed = false;
+    bool failed = false;
+
+    if (!consume_token(context, TK_END_OBJECT)) {
+        do {
+            const char *key;
+            // 文字列の取り出しはメモリ不足のときだけ失敗する
+            if (!expect_string(context, &key)) {
+                failed = true;
+                break;
+            }
+            consume_token(context, TK_NAME_SEP);
+            JSONMember *found = find_member(&table, key);
+
+            if (consume_token(context, TK_NULL)) {
+                if (found && found->value) {
+                    free_json(found->value);
+                    found->value = NULL;
+                    removed = true;
+                }
+                free((char *)key);
+                continue;
+            }
+
+            if (!found) {
+                if (!(found = malloc(sizeof(JSONMember)))) {
+                    ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+                    free((char *)key);
+                    failed = true;
+                    break;
+                }
+                found->key = key;
+                found->value = NULL;
+                found->next = NULL;
+                *tail = found;
+                tail = &found->next;
+                insert_member(&table, found);
+            }
+            else {
+                free((char *)key);
+            }
+            if (!patch_value(context, &found->value)) {
+                // 追加したばかりのメンバは値がNULLのままなので片付ける
+                if (!found->value)
+                    removed = true;
+                failed = true;
+                break;
+            }
+        } while (consume_token(context, TK_VALUE_SEP));
+        if (!failed)
+            consume_token(context, TK_END_OBJECT);
+    }
+    free(table.slots);
+
+    if (removed)
+        remove_members(object);
+    update_hash(object);
+    if (object != target) {
+        if (failed) {
+            free_json(object);
+            return false;
+        }
+        free_json(target);
+        *target_ptr = object;
+    }
+    return !failed;
+}
+
+// Applies the merge patch in patch to target and returns the result;
+// target is consumed. On failure NULL is returned with the error in
+// ERROR_FLAGS and ERROR_INFO, and target still belongs to the caller:
+// unchanged if the patch is not valid JSON, possibly with part of the patch
+// applied if memory ran out.
+// The patch is lexed once: its grammar is checked on the structural index
+// before anything is changed.
+JSONValue *merge_patch_text(JSONValue *target, const char *patch)
+{
+    StructuralIndex *index = build_index(patch);
+    if (!index)
+        return NULL;
+    if (!validate_indexed(patch, index)) {
+        free_index(index);
+        return NULL;
+    }
+
+    Context context;
+    context.depth = 0;
+    context.code = patch;
+    context.index = index;
+    context.position = 0;
+    load_token(&context);
+
+    bool patched = patch_value(&context, &target);
+    if (context.token.kind == TK_STR)
+        free((char *)context.token.str);
+    free_index(index);
+    if (!patched) {
+        ERROR_FLAGS |= PARSE_ERROR;
+        locate_error(patch, NULL);
+        return NULL;
+    }
+    return target;
+}
@@ -0,0 +1,248 @@
+#include <threads.h>
+#include "cjson.h"
+
+// Parallel parsing of a document whose top level value is an array.
+//
+// 1. Scan:  every chunk counts its unescaped quotes and the bracket depth
+//           change for both possible "inside a string" states at its start.
+// 2. Split: with the states known from a prefix over the chunks, every chunk
+//           looks for its first comma at the top level of the array.
+// 3. Parse: the slices between those commas are tokenized and parsed as
+//           element lists, then linked into a single array node.
+//
+// Chunk boundaries never follow a backslash, so a chunk never starts with an
+// escaped character and the quote parity does not depend on the state.
+// Anything unexpected falls back to parse(), which also gives the exact
+// ERROR_FLAGS of the sequential parser.
+
+#define MAX_PARALLEL_THREADS 256
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    const char *begin;
+    const char *end;
+
+    // Scan
+    bool quote_parity;
+    long depth_delta[2]; // 先頭が文字列の外/中の場合
+    bool in_string;
+    long depth;
+
+    // Split
+    const char *split; // 最初のトップレベルの','. なければNULL
+
+    // Parse
+    const char *slice_begin;
+    const char *slice_end;
+    JSONValue *head;
+    JSONValue *tail;
+    unsigned char error_flags;
+};
+
+static bool is_whitespace(char c)
+{
+    return c == '\x20' || c == '\x09' || c == '\x0A' || c == '\x0D';
+}
+
+static int scan_chunk(void *arg)
+{
+    Chunk *chunk = arg;
+    bool parity = false;
+    long delta[2] = { 0, 0 };
+    for (const char *p = chunk->begin; chunk->end > p; p++) {
+        switch (*p) {
+            case '\\':
+                p++;
+                break;
+            case '"':
+                parity = !parity;
+                break;
+            case '[':
+            case '{':
+                delta[parity]++;
+                break;
+            case ']':
+            case '}':
+                delta[parity]--;
+                break;
+        }
+    }
+    chunk->quote_parity = parity;
+    chunk->depth_delta[0] = delta[0];
+    chunk->depth_delta[1] = delta[1];
+    return 0;
+}
+
+static int split_chunk(void *arg)
+{
+    Chunk *chunk = arg;
+    bool in_string = chunk->in_string;
+    long depth = chunk->depth;
+    chunk->split = NULL;
+    for (const char *p = chunk->begin; chunk->end > p; p++) {
+        if (*p == '\\') {
+            p++;
+        }
+        else if (*p == '"') {
+            in_string = !in_string;
+        }
+        else if (in_string) {
+            continue;
+        }
+        else if (*p == '[' || *p == '{') {
+            depth++;
+        }
+        else if (*p == ']' || *p == '}') {
+            depth--;
+        }
+        else if (*p == ',' && depth == 0) {
+            chunk->split = p;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int parse_chunk(void *arg)
+{
+    Chunk *chunk = arg;
+    reset_error();
+    chunk->head = NULL;
+
+    Token *tokens = tokenize_range(chunk->slice_begin, chunk->slice_end);
+    if (!ERROR_FLAGS) {
+        Context context;
+        context.current_token = tokens;
+        context.depth = 1;
+        context.index = NULL;
+        chunk->head = elements_node(&context, &chunk->tail);
+        free_tokens(context.current_token);
+    }
+    chunk->error_flags = ERROR_FLAGS;
+    return 0;
+}
+
+static bool run_chunks(Chunk *chunks, unsigned int n, thrd_start_t func)
+{
+    thrd_t threads[MAX_PARALLEL_THREADS];
+    unsigned int started = 1;
+    bool ok = true;
+    for (; n > started; started++) {
+        if (thrd_create(&threads[started], func, &chunks[started]) != thrd_success) {
+            ok = false;
+            break;
+        }
+    }
+    func(&chunks[0]);
+    for (unsigned int i = 1; started > i; i++)
+        thrd_join(threads[i], NULL);
+    return ok;
+}
+
+JSONValue *parse_parallel(const char *code, unsigned int threads)
+{
+    const char *begin = code;
+    const char *end = code + strlen(code);
+    while (end > begin && is_whitespace(*begin))
+        begin++;
+    while (end > begin && is_whitespace(end[-1]))
+        end--;
+    if (end - begin < 2 || *begin != '[' || end[-1] != ']')
+        return parse(code);
+
+    // Contents of the top level array
+    begin++;
+    end--;
+
+    size_t length = end - begin;
+    if (threads > MAX_PARALLEL_THREADS)
+        threads = MAX_PARALLEL_THREADS;
+    if (threads > length / PARALLEL_MIN_CHUNK_SIZE)
+        threads = length / PARALLEL_MIN_CHUNK_SIZE;
+    if (threads <= 1)
+        return parse(code);
+
+    // Every chunk may end a slice, plus the last slice up to the closing ']'
+    Chunk *chunks = calloc(threads + 1, sizeof(Chunk));
+    if (!chunks)
+        return parse(code);
+
+    const char *boundary = begin;
+    for (unsigned int i = 0; threads > i; i++) {
+        chunks[i].begin = boundary;
+        boundary = i + 1 == threads ? end : begin + length / threads * (i + 1);
+        if (chunks[i].begin > boundary)
+            boundary = chunks[i].begin;
+        while (end > boundary && boundary > begin && boundary[-1] == '\\')
+            boundary++;
+        chunks[i].end = boundary;
+    }
+
+    if (!run_chunks(chunks, threads, scan_chunk))
+        goto fallback;
+
+    bool in_string = false;
+    long depth = 0;
+    for (unsigned int i = 0; threads > i; i++) {
+        chunks[i].in_string = in_string;
+        chunks[i].depth = depth;
+        depth += chunks[i].depth_delta[in_string];
+        in_string ^= chunks[i].quote_parity;
+    }
+    if (in_string || depth != 0)
+        goto fallback;
+
+    if (!run_chunks(chunks, threads, split_chunk))
+        goto fallback;
+
+    // Slices run from one split to the next. Chunks without a split are
+    // covered by the slice of an earlier chunk.
+    unsigned int slices = 0;
+    const char *slice_begin = begin;
+    for (unsigned int i = 0; threads > i; i++) {
+        if (!chunks[i].split)
+            continue;
+        chunks[slices].slice_begin = slice_begin;
+        chunks[slices].slice_end = chunks[i].split;
+        slice_begin = chunks[i].split + 1;
+        slices++;
+    }
+    chunks[slices].slice_begin = slice_begin;
+    chunks[slices].slice_end = end;
+    slices++;
+
+    bool started = run_chunks(chunks, slices, parse_chunk);
+
+    JSONValue *node = NULL;
+    bool failed = !started;
+    for (unsigned int i = 0; slices > i; i++)
+        if (chunks[i].error_flags || !chunks[i].head)
+            failed = true;
+    if (!failed && !(node = new_node(JV_ARRAY)))
+        failed = true;
+
+    if (failed) {
+        for (unsigned int i = 0; slices > i; i++) {
+            JSONValue *element = chunks[i].head;
+            while (element) {
+                JSONValue *next = element->next;
+                free_json(element);
+                element = next;
+            }
+        }
+        free_json(node);
+        goto fallback;
+    }
+
+    for (unsigned int i = 0; slices > i + 1; i++)
+        chunks[i].tail->next = chunks[i + 1].head;
+    node->elements = chunks[0].head;
+    update_hash(node);
+    free(chunks);
+    reset_error();
+    return node;
+
+fallback:
+    free(chunks);
+    return parse(code);
+}
@@ -1,6 +1,6 @@
 #include "cjson.h"
 
-static JSONValue *new_node(JSONValueType type)
+JSONValue *new_node(JSONValueType type)
 {
     JSONValue *node = malloc(sizeof(JSONValue));
     if (!node) {
@@ -12,7 +12,8 @@ static JSONValue *new_node(JSONValueType type)
 }
 
 JSONValue *json_node(Context *context);
-static JSONValue *value_node(Context *context);
+JSONValue *elements_node(Context *context, JSONValue **tail_ptr);
+JSONValue *value_node(Context *context);
 static JSONValue *array_node(Context *context);
 static JSONValue *object_node(Context *context);
 static JSONMember *member_node(Context *context);
@@ -28,25 +29,55 @@ static void free_object_members(JSONMember *value);
 // json = ws value ws
 JSONValue *json_node(Context *context)
 {
-    if (at_eof(context))
-        return NULL;
-
     JSONValue *node = value_node(context);
-    if (!node || !at_eof(context))
+    if (!node)
         goto failed;
+    if (!at_eof(context)) {
+        set_error(JE_TRAILING_DATA, context->current_token->pos);
+        goto failed;
+    }
     return node;
 
 failed:
+    free_json(node);
+    ERROR_FLAGS |= PARSE_ERROR;
+    return NULL;
+}
+
+// elements = value *( value-separator value )
+// 配列の中身の一部だけを解析する. parse_parallel()が分割した区間に使う.
+JSONValue *elements_node(Context *context, JSONValue **tail_ptr)
+{
+    JSONValue dummy;
+    dummy.next = NULL;
+    JSONValue *head = &dummy;
+
+    while (true) {
+        if (!(head->next = value_node(context)))
+            goto failed;
+        head = head->next;
+        head->next = NULL;
+        if (at_eof(context))
+            break;
+        if (!expect_token(context, TK_VALUE_SEP))
+            goto failed;
+    }
+    *tail_ptr = head;
+    return dummy.next;
+
+failed:
+    free_array_elements(dummy.next);
     ERROR_FLAGS |= PARSE_ERROR;
     return NULL;
 }
 
 // value = false / null / true / object / array / number / string
-static JSONValue *value_node(Context *context)
+JSONValue *value_node(Context *context)
 {
     JSONValue *node = NULL;
     long double num;
     const char *str = NULL;
+    const char *pos = context->current_token->pos;
     if (consume_token(context, TK_FALSE)) {
         if (!(node = new_node(JV_BOOL)))
             return NULL;
@@ -67,21 +98,34 @@ static JSONValue *value_node(Context *context)
         node->num = num;
     }
     else if (consume_string(context, &str)) {
-        if (!(node = new_node(JV_STR)))
+        if (!(node = new_node(JV_STR))) {
+            free((char *)str);
             return NULL;
+        }
         node->str = str;
     }
     else if (consume_token(context, TK_BEGIN_ARRAY)) {
-        if (!(node = array_node(context)))
+        if (context->depth++ >= MAX_NESTING_DEPTH) {
+            set_error(JE_TOO_DEEP, pos);
             return NULL;
+        }
+        node = array_node(context);
+        context->depth--;
     }
     else if (consume_token(context, TK_BEGIN_OBJECT)) {
-        if (!(node = object_node(context)))
+        if (context->depth++ >= MAX_NESTING_DEPTH) {
+            set_error(JE_TOO_DEEP, pos);
             return NULL;
+        }
+        node = object_node(context);
+        context->depth--;
     }
     else {
+        set_error(at_eof(context) ? JE_UNEXPECTED_EOF : JE_UNEXPECTED_TOKEN, pos);
         return NULL;
     }
+    if (node)
+        update_hash(node);
     return node;
 }
 
@@ -161,19 +205,26 @@ static JSONMember *member_node(Context *context)
         return NULL;
 
     if (!expect_token(context, TK_NAME_SEP))
-        return NULL;
+        goto failed;
 
     JSONValue *value = value_node(context);
     if (!value)
-        return NULL;
+        goto failed;
 
     JSONMember *node = malloc(sizeof(JSONMember));
-    if (!node)
-        return NULL;
+    if (!node) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        free_value(value);
+        goto failed;
+    }
     node->key = key;
     node->value = value;
     node->next = NULL;
     return node;
+
+failed:
+    free((char *)key);
+    return NULL;
 }
 
 void free_json(JSONValue *value)
@@ -205,6 +256,8 @@ static void free_value(JSONValue *value)
 
 static void free_primitive(JSONValue *value)
 {
+    if (value->type == JV_STR)
+        free((char *)value->str);
     free(value);
 }
 
@@ -218,11 +271,11 @@ static void free_array(JSONValue *value)
 
 static void free_array_elements(JSONValue *value)
 {
-    if (!value)
-        return;
-    if (value->next)
-        free_array_elements(value->next);
-    free_value(value);
+    while (value) {
+        JSONValue *next = value->next;
+        free_value(value);
+        value = next;
+    }
 }
 
 static void free_object(JSONValue *value)
@@ -235,10 +288,11 @@ static void free_object(JSONValue *value)
 
 static void free_object_members(JSONMember *value)
 {
-    if (!value)
-        return;
-    if (value->next)
-        free_object_members(value->next);
-    free_value(value->value);
-    free(value);
+    while (value) {
+        JSONMember *next = value->next;
+        free((char *)value->key);
+        free_value(value->value);
+        free(value);
+        value = next;
+    }
 }
@@ -1,5 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <threads.h>
 #include "cjson.h"
 
 typedef unsigned char byte;
@@ -7,6 +14,18 @@ typedef signed char sbyte;
 
 static void dump_json(JSONValue *value, unsigned int depth);
 
+// Checks with a known result make main() fail; the rest of the output is
+// compared by eye.
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (ok)
+        return;
+    printf("Check failed: %s\n", what);
+    failures++;
+}
+
 static void print_tabs(unsigned int depth)
 {
     for (unsigned int i = 0; depth > i; i++)
@@ -65,6 +84,13 @@ static void dump_json(JSONValue *value, unsigned int depth)
     }
 }
 
+static void print_error(void)
+{
+    printf("ERROR_FLAGS: %02x\n", ERROR_FLAGS);
+    printf("%s at offset %zu (line %u, column %u)\n", error_message(ERROR_INFO.code),
+           ERROR_INFO.offset, ERROR_INFO.line, ERROR_INFO.column);
+}
+
 static void test(const char *code)
 {
     printf("==================== Code =======================\n");
@@ -79,7 +105,7 @@ static void test(const char *code)
 
     printf("=================== Detail ======================\n");
     if (ERROR_FLAGS)
-        printf("ERROR_FLAGS: %02x\n", ERROR_FLAGS);
+        print_error();
     else
         dump_json(value, 0);
 
@@ -87,6 +113,385 @@ static void test(const char *code)
     free_json(value);
 }
 
+static void test_validate(const char *code)
+{
+    printf("=================== Validate ====================\n");
+    printf("%s\n", code);
+
+    printf("=================== Result ======================\n");
+    if (json_validate(code, strlen(code)))
+        printf("Valid\n");
+    else
+        print_error();
+    printf("=================================================\n");
+}
+
+// Parses every element of a top level array separately through the index.
+static void test_indexed(const char *code)
+{
+    printf("==================== Code =======================\n");
+    printf("%s\n", code);
+
+    printf("=================== Result ======================\n");
+    StructuralIndex *index = build_index(code);
+    if (ERROR_FLAGS)
+        printf("Failure\n");
+    else
+        printf("Success (%u tokens)\n", index->size);
+
+    printf("=================== Detail ======================\n");
+    if (ERROR_FLAGS) {
+        printf("ERROR_FLAGS: %02x\n", ERROR_FLAGS);
+    }
+    else if (index->size && code[index->offsets[0]] == '[') {
+        uint32_t position = 1;
+        while (index->size > position && code[index->offsets[position]] != ']') {
+            JSONValue *value = parse_indexed_value(code, index, position);
+            if (ERROR_FLAGS)
+                printf("ERROR_FLAGS: %02x\n", ERROR_FLAGS);
+            dump_json(value, 0);
+            free_json(value);
+            position = skip_indexed_value(code, index, position);
+            if (index->size > position && code[index->offsets[position]] == ',')
+                position++;
+        }
+    }
+
+    printf("=================================================\n");
+    free_index(index);
+}
+
+// An index used with a buffer it was not built for must be rejected.
+static void test_index_mismatch(const char *code, const char *other)
+{
+    printf("================ Index mismatch =================\n");
+    printf("%s\n%s\n", code, other);
+    printf("=================== Result ======================\n");
+    StructuralIndex *index = build_index(code);
+    JSONValue *value = parse_indexed(other, index);
+    printf("parse_indexed(): %s (%s)\n", value ? "Accepted" : "Rejected", error_message(ERROR_INFO.code));
+    check(!value && ERROR_INFO.code == JE_INDEX_MISMATCH, "parse_indexed() of another buffer");
+    free_json(value);
+    value = parse_indexed_value(other, index, index->size - 1);
+    printf("parse_indexed_value(): %s (%s)\n", value ? "Accepted" : "Rejected", error_message(ERROR_INFO.code));
+    check(!value && ERROR_INFO.code == JE_INDEX_MISMATCH, "parse_indexed_value() of another buffer");
+    free_json(value);
+    uint32_t position = skip_indexed_value(other, index, 0);
+    printf("skip_indexed_value(): %u of %u (%s)\n", position, index->size, error_message(ERROR_INFO.code));
+    check(ERROR_INFO.code == JE_INDEX_MISMATCH, "skip_indexed_value() of another buffer");
+
+    // 保存した索引を読み込んだときのような壊れたoffset
+    index->offsets[index->size - 1] = UINT32_MAX;
+    value = parse_indexed(code, index);
+    printf("corrupted offset: %s (%s)\n", value ? "Accepted" : "Rejected", error_message(ERROR_INFO.code));
+    check(!value && ERROR_INFO.code == JE_INDEX_MISMATCH, "parse_indexed() with a corrupted offset");
+    free_json(value);
+    printf("=================================================\n");
+    free_index(index);
+}
+
+static void test_equal(const char *a, const char *b)
+{
+    printf("==================== Equal ======================\n");
+    printf("%s\n%s\n", a, b);
+    printf("=================== Result ======================\n");
+    JSONValue *x = parse(a);
+    JSONValue *y = parse(b);
+    if (!x || !y)
+        printf("Failure\n");
+    else
+        printf("%s, hashes %s\n", equal_json(x, y) ? "Equal" : "Not equal",
+               x->hash == y->hash ? "equal" : "differ");
+    printf("=================================================\n");
+    free_json(x);
+    free_json(y);
+}
+
+static void test_canonical(const char *code)
+{
+    printf("================== Canonical ====================\n");
+    printf("%s\n", code);
+    printf("=================== Result ======================\n");
+    JSONValue *value = parse(code);
+    char *canonical = value ? canonicalize_json(value) : NULL;
+    if (canonical)
+        printf("%s\n", canonical);
+    else
+        printf("ERROR_FLAGS: %02x\n", ERROR_FLAGS);
+    printf("=================================================\n");
+    free(canonical);
+    free_json(value);
+}
+
+#define INGEST_TEST_FILES 8
+
+// Reads files through the ingestion pipeline with a tiny memory limit.
+static void test_ingest(unsigned int flags)
+{
+    static const char *contents[INGEST_TEST_FILES] = {
+        "{ \"id\": 0, \"tags\": [\"a\", \"b\"] }",
+        "[ 1, 2, 3 ]",
+        "",
+        "{ \"broken\": ",
+        NULL, // missing file
+        "\"  a longer string that does not fit into the memory limit on its own  \"",
+        NULL, // FIFO
+        NULL, // /proc/self/status
+    };
+    // 0ならparse()のERROR_FLAGS, そうでなければio_errorを確かめる
+    static const int expected_errors[INGEST_TEST_FILES] = { 0, 0, 0, 0, ENOENT, 0, EINVAL, EINVAL };
+    static const unsigned char expected_flags[INGEST_TEST_FILES] = { 0, 0, PARSE_ERROR, PARSE_ERROR, 0, 0, 0, 0 };
+    char paths[INGEST_TEST_FILES][64];
+    IngestResult results[INGEST_TEST_FILES];
+    memset(results, 0, sizeof(results));
+
+    printf("==================== Ingest =====================\n");
+    printf("flags: %02x\n", flags);
+
+    char directory[] = "/tmp/cjson_ingest_XXXXXX";
+    if (!mkdtemp(directory)) {
+        check(false, "mkdtemp()");
+        return;
+    }
+    Ingest *ingest = new_ingest(2, 64, flags);
+    if (!ingest) {
+        printf("Failure\n");
+        rmdir(directory);
+        return;
+    }
+
+    for (unsigned int i = 0; INGEST_TEST_FILES > i; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/ingest_%u.json", directory, i);
+        // 通常のファイルでなければ大きさが分からないので読まない
+        if (i == 6)
+            mkfifo(paths[i], 0600);
+        if (i == 7)
+            snprintf(paths[i], sizeof(paths[i]), "/proc/self/status");
+        if (contents[i]) {
+            FILE *fp = fopen(paths[i], "w");
+            if (fp) {
+                fputs(contents[i], fp);
+                fclose(fp);
+            }
+        }
+        check(submit_ingest(ingest, paths[i], &results[i]), "submit_ingest()");
+    }
+
+    IngestResult result;
+    unsigned int count = 0;
+    while (next_ingest(ingest, &result)) {
+        *(IngestResult *)result.user_data = result;
+        count++;
+    }
+    printf("%u results\n", count);
+    check(count == INGEST_TEST_FILES, "one ingest result per file");
+
+    for (unsigned int i = 0; INGEST_TEST_FILES > i; i++) {
+        printf("=================== ingest_%u.json ===============\n", i);
+        if (results[i].io_error)
+            printf("I/O error: %s\n", strerror(results[i].io_error));
+        else if (results[i].error_flags)
+            printf("ERROR_FLAGS: %02x\n", results[i].error_flags);
+        else
+            dump_json(results[i].value, 0);
+        check(results[i].io_error == expected_errors[i], "ingest io_error");
+        if (!expected_errors[i])
+            check(results[i].error_flags == expected_flags[i] && !results[i].value == !!expected_flags[i],
+                  "ingest parse result");
+        free_json(results[i].value);
+        if (i != 7)
+            remove(paths[i]);
+    }
+    rmdir(directory);
+
+    printf("=================================================\n");
+    free_ingest(ingest);
+}
+
+#define DOCUMENT_TEST_READERS 4
+#define DOCUMENT_TEST_VERSIONS 200
+
+typedef struct DocumentReader DocumentReader;
+struct DocumentReader {
+    JSONDocumentSlot *slot;
+    atomic_bool *done;
+    unsigned long reads;
+    bool consistent;
+};
+
+// Every element of "items" must equal "version" of the same document.
+static int document_reader(void *arg)
+{
+    DocumentReader *reader = arg;
+    while (!atomic_load(reader->done) || !reader->reads) {
+        JSONDocument *document = acquire_document(reader->slot);
+        const JSONValue *root = document_root(document);
+        long double version = root->members->value->num;
+        for (const JSONValue *item = root->members->next->value->elements; item; item = item->next)
+            if (item->num != version)
+                reader->consistent = false;
+        release_document(document);
+        reader->reads++;
+    }
+    return 0;
+}
+
+// Publishes new versions while readers traverse the current one.
+static void test_document(void)
+{
+    printf("=================== Document ====================\n");
+    JSONDocumentSlot *slot = new_document_slot(new_document(parse("{ \"version\": 0, \"items\": [ 0, 0, 0, 0 ] }")));
+    atomic_bool done;
+    atomic_init(&done, false);
+
+    thrd_t threads[DOCUMENT_TEST_READERS];
+    DocumentReader readers[DOCUMENT_TEST_READERS];
+    for (unsigned int i = 0; DOCUMENT_TEST_READERS > i; i++) {
+        readers[i].slot = slot;
+        readers[i].done = &done;
+        readers[i].reads = 0;
+        readers[i].consistent = true;
+        thrd_create(&threads[i], document_reader, &readers[i]);
+    }
+
+    JSONDocument *kept = acquire_document(slot);
+    char code[128];
+    for (unsigned int version = 1; DOCUMENT_TEST_VERSIONS >= version; version++) {
+        snprintf(code, sizeof(code), "{ \"version\": %u, \"items\": [ %u, %u, %u, %u ] }",
+                 version, version, version, version, version);
+        publish_document(slot, new_document(parse(code)));
+        thrd_yield();
+    }
+    atomic_store(&done, true);
+
+    bool consistent = true;
+    for (unsigned int i = 0; DOCUMENT_TEST_READERS > i; i++) {
+        thrd_join(threads[i], NULL);
+        consistent = consistent && readers[i].consistent;
+    }
+    printf("readers %s\n", consistent ? "consistent" : "inconsistent");
+    check(consistent, "readers of published documents");
+
+    // 置き換えられた後も持っている間は使える
+    dump_json((JSONValue *)document_root(kept), 0);
+    check(document_root(kept)->members->value->num == 0, "document kept after being replaced");
+    release_document(kept);
+    JSONDocument *current = acquire_document(slot);
+    dump_json((JSONValue *)document_root(current), 0);
+    check(document_root(current)->members->value->num == DOCUMENT_TEST_VERSIONS, "latest published document");
+    release_document(current);
+    printf("=================================================\n");
+    free_document_slot(slot);
+}
+
+// Prints the canonical form and returns whether it is expected, which is
+// NULL for a failure.
+static bool print_canonical(JSONValue *value, const char *expected)
+{
+    char *canonical = value ? canonicalize_json(value) : NULL;
+    printf("%s\n", canonical ? canonical : "Failure");
+    bool ok = canonical && expected ? !strcmp(canonical, expected) : !canonical && !expected;
+    free(canonical);
+    return ok;
+}
+
+// Applies patch to target as a tree, as text and as a deep merge.
+// expected is the canonical result of the merge patch, NULL if it fails.
+static void test_merge(const char *target, const char *patch, const char *expected)
+{
+    printf("==================== Merge ======================\n");
+    printf("%s\n%s\n", target, patch);
+    printf("=================== Result ======================\n");
+    JSONValue *patched = merge_patch(parse(target), parse(patch));
+    check(print_canonical(patched, expected), "merge_patch()");
+
+    JSONValue *original = parse(target);
+    JSONValue *streamed = merge_patch_text(original, patch);
+    if (!streamed) {
+        // 失敗してもtargetは呼び出し側のもの
+        printf("merge_patch_text() kept the target: ");
+        JSONValue *unchanged = parse(target);
+        char *canonical = canonicalize_json(unchanged);
+        check(print_canonical(original, canonical), "target of a failed merge_patch_text()");
+        free(canonical);
+        free_json(unchanged);
+        free_json(original);
+    }
+    printf("merge_patch_text(): %s\n",
+           !streamed ? "Failure" : patched && equal_json(patched, streamed) ? "same" : "different");
+    check(streamed ? patched && equal_json(patched, streamed) : !patched, "merge_patch_text()");
+
+    JSONValue *merged = merge_json(parse(target), parse(patch));
+    print_canonical(merged, NULL);
+    printf("=================================================\n");
+    free_json(patched);
+    free_json(streamed);
+    free_json(merged);
+}
+
+static bool append_output(void *user_data, const char *data, size_t size)
+{
+    for (size_t i = 0; size > i; i++)
+        if (!append_sb(user_data, data[i]))
+            return false;
+    return true;
+}
+
+static void test_writer(void)
+{
+    printf("==================== Writer =====================\n");
+    StringBuilder builder;
+    initial_sb(&builder);
+    JSONWriter *writer = new_writer(append_output, &builder);
+    write_begin_object(writer);
+    write_key(writer, "id");
+    write_int(writer, -9223372036854775807LL - 1);
+    write_key(writer, "scores");
+    write_begin_array(writer);
+    write_double(writer, 0.1);
+    write_double(writer, 19.99);
+    write_double(writer, -0.0);
+    write_double(writer, 1e300);
+    write_double(writer, 1.0 / 3);
+    write_double(writer, 5e-324);
+    write_double(writer, 1.7976931348623157e308);
+    write_double(writer, 9007199254740993.0);
+    write_end_array(writer);
+    write_key(writer, "name");
+    write_string(writer, "tab\there \"quoted\" back\\slash \x01 \xe3\x81\x82 end of a longer run");
+    write_key(writer, "empty");
+    write_begin_object(writer);
+    write_end_object(writer);
+    write_key(writer, "flags");
+    write_begin_array(writer);
+    write_bool(writer, true);
+    write_null(writer);
+    write_end_array(writer);
+    write_end_object(writer);
+    bool finished = finish_writer(writer);
+    free_writer(writer);
+    finished = finished && get_str_sb(&builder);
+    printf("%s\n", finished ? builder.str : "Failure");
+    check(finished && !strcmp(builder.str,
+                              "{\"id\":-9223372036854775808,\"scores\":[0.1,19.99,-0,1e+300,0.3333333333333333,"
+                              "5e-324,1.7976931348623157e+308,9007199254740992],"
+                              "\"name\":\"tab\\there \\\"quoted\\\" back\\\\slash \\u0001 \xe3\x81\x82 "
+                              "end of a longer run\",\"empty\":{},\"flags\":[true,null]}"),
+          "write_*() output");
+
+    // オブジェクトの中でキーなしの値
+    builder.size = 0;
+    writer = new_writer(append_output, &builder);
+    write_begin_object(writer);
+    bool written = write_int(writer, 1);
+    printf("%s, ERROR_FLAGS: %02x\n", written ? "Written" : "Rejected", ERROR_FLAGS);
+    check(!written && ERROR_FLAGS == WRITE_ERROR, "value without a key rejected");
+    free_writer(writer);
+    ERROR_FLAGS = 0;
+    free(builder.str);
+    printf("=================================================\n");
+}
+
 static void test_from_file(const char *filename)
 {
     FILE *fp = fopen(filename, "r");
@@ -113,6 +518,7 @@ static void test_from_file(const char *filename)
     fclose(fp);
 
     test(get_str_sb(&builder));
+    free(builder.str);
 }
 
 int main(int argc, char **argv)
@@ -176,6 +582,72 @@ int main(int argc, char **argv)
     test_from_file("test/case1.json");
     test_from_file("test/case2.json");
 
+    test_indexed("   [  \"string\", true, false, 3.14, null, {}  ]  ");
+    test_indexed("[ [1, [2, 3]], { \"a\": [ \"]\" ] }, \"x\" ]");
+    test_indexed("[ \"fail\", tru ]");
+    test_index_mismatch("[ 1, 2, 3 ]", "[ 1 ]");
+    test_index_mismatch("[ 1 ]", "[ 1 ]  ");
+
+    test_ingest(0);
+    test_ingest(INGEST_THREAD_POOL);
+    test_document();
+    test_writer();
+
+    test_equal("{ \"a\": 1, \"b\": [true, null] }", "{\"b\":[true,null],\"a\":1.0}");
+    test_equal("[ 100, 0.5, -0 ]", "[ 1e2, 5E-1, 0 ]");
+    test_equal("[ 1, 2 ]", "[ 2, 1 ]");
+    test_equal("[ 0.1 ]", "[ 0.10000000000000000001 ]");
+    test_equal("{ \"a\": \"x\" }", "{ \"a\": \"x\", \"b\": \"x\" }");
+    test_canonical("{ \"b\": [ 1e21, 1e-7, 123.456, -0, 0.000001 ], \"a\": \"tab\\t\" }");
+    test_canonical("{ \"\xef\xbd\xa1\": 1, \"\xf0\x9f\x98\x80\": 2, \"\x0a\": 3, \"1\": 4 }");
+    test_canonical("[ 1e99999 ]");
+
+    test_merge("{ \"a\": \"b\" }", "{ \"a\": \"c\" }", "{\"a\":\"c\"}");
+    test_merge("{ \"a\": \"b\", \"b\": \"c\" }", "{ \"a\": null }", "{\"b\":\"c\"}");
+    test_merge("{ \"a\": [ { \"b\": \"c\" } ] }", "{ \"a\": [ 1 ] }", "{\"a\":[1]}");
+    test_merge("[ 1, 2 ]", "{ \"a\": \"b\", \"c\": null }", "{\"a\":\"b\"}");
+    test_merge("{ \"e\": null }", "{ \"a\": 1 }", "{\"a\":1,\"e\":null}");
+    test_merge("{ \"a\": \"foo\" }", "\"bar\"", "\"bar\"");
+    test_merge("{ \"a\": { \"b\": \"c\" } }", "{ \"a\": { \"b\": \"d\", \"c\": null } }", "{\"a\":{\"b\":\"d\"}}");
+    test_merge("{ \"title\": \"Goodbye!\", \"author\": { \"givenName\": \"John\", \"familyName\": \"Doe\" }, "
+               "\"tags\": [ \"example\", \"sample\" ], \"content\": \"This will be unchanged\" }",
+               "{ \"title\": \"Hello!\", \"phoneNumber\": \"+01-123-456-7890\", \"author\": { \"familyName\": null }, "
+               "\"tags\": [ \"example\" ] }",
+               "{\"author\":{\"givenName\":\"John\"},\"content\":\"This will be unchanged\","
+               "\"phoneNumber\":\"+01-123-456-7890\",\"tags\":[\"example\"],\"title\":\"Hello!\"}");
+    test_merge("{ \"k0\": 0, \"k1\": 1, \"k2\": 2, \"k3\": 3, \"k4\": 4, \"k5\": 5, \"k6\": 6, \"k7\": 7, \"k8\": 8, "
+               "\"k9\": 9, \"k10\": 10, \"k11\": 11, \"k12\": 12, \"k13\": 13, \"k14\": 14, \"k15\": 15, \"k16\": 16 }",
+               "{ \"k3\": null, \"k16\": { \"x\": null }, \"k17\": 17, \"k3\": 33, \"k0\": null }",
+               "{\"k1\":1,\"k10\":10,\"k11\":11,\"k12\":12,\"k13\":13,\"k14\":14,\"k15\":15,\"k16\":{},"
+               "\"k17\":17,\"k2\":2,\"k3\":33,\"k4\":4,\"k5\":5,\"k6\":6,\"k7\":7,\"k8\":8,\"k9\":9}");
+    test_merge("{ \"a\": 1 }", "{ \"a\": }", NULL);
+    test_merge("{ \"a\": 1 }", "{ \"a\": 2 } 3", NULL);
+    test_merge("{ \"x\": 1, \"y\": 1 }", "{ \"x\": 2, \"y\": }", NULL);
+    test_merge("{}", "{ \"a\": { \"b\": [ 1 } }", NULL);
+
+    test("  [ 01 ] ");
+    test("[ 1., .5 ]");
+    test("{\n  \"a\": 1,\n  \"b\": [ true, fals ]\n}");
+    test("{\n  \"a\": 1\n  \"b\": 2\n}");
+    test_validate("   [  \"string\", true, false, 3.14, null, {}  ]  ");
+    test_validate("{ \"a\": [ 1, 2 }");
+    test_validate("{\n  \"a\": \"\\q\"\n}");
+    test_validate("[ 1, 2 ] 3");
+    test_validate("[ -1.5e+3, 0, -0.0 ]");
+    test_validate("");
+    test_validate("\"\\u0041\\u00e9\\ud83d\\ude00\"");
+    test_validate("\"raw\ttab\"");
+    test_validate("\"\\u12\"");
+    test("\"\\u0041\\u00e9\\ud83d\\ude00 \\ud800 \\u0000\"");
+    test_canonical("[ \"\\u0000\\u001f\\ud83d\\ude00\" ]");
+    test_canonical("{ \"a\\u0000\": 2, \"a\": 1, \"a\\u0000b\": 3 }");
+    test_canonical("{ \"a\\u0000b\": 3, \"a\": 1, \"a\\u0000\": 2 }");
+    test("   ");
+
     printf("================== Finish test ==================\n");
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,174 @@
+#include "cjson.h"
+
+// Well-formedness check without building tokens or nodes.
+//
+// Uses the same scanners as the lexer and accepts exactly what parse()
+// accepts, with the same nesting limit. The open containers are kept in a
+// fixed stack, so nothing is allocated.
+//
+// validate_indexed() runs the same grammar over a structural index, so a
+// document that has been indexed can be checked without lexing it again.
+// The index must fit the document, see index_matches().
+
+typedef enum ValidateState ValidateState;
+enum ValidateState {
+    VS_VALUE,       // value
+    VS_FIRST_VALUE, // value or ']' right after '['
+    VS_KEY,         // member name
+    VS_FIRST_KEY,   // member name or '}' right after '{'
+    VS_NAME_SEP,    // ':'
+    VS_AFTER_VALUE, // ',' or the end of the container
+};
+
+typedef struct Validator Validator;
+struct Validator {
+    char stack[MAX_NESTING_DEPTH];
+    unsigned int depth;
+    ValidateState state;
+};
+
+static void initial_validator(Validator *validator)
+{
+    validator->depth = 0;
+    validator->state = VS_VALUE;
+}
+
+// Feeds the token at pos. On an error it is set and PARSE_ERROR is added.
+static bool validate_token(Validator *validator, TokenKind kind, const char *pos)
+{
+    if (validator->state == VS_AFTER_VALUE && !validator->depth) {
+        set_error(JE_TRAILING_DATA, pos);
+        goto failed;
+    }
+
+    switch (validator->state) {
+        case VS_FIRST_VALUE:
+            if (kind == TK_END_ARRAY) {
+                validator->depth--;
+                validator->state = VS_AFTER_VALUE;
+                return true;
+            }
+            // fallthrough
+        case VS_VALUE:
+            if (kind == TK_BEGIN_ARRAY || kind == TK_BEGIN_OBJECT) {
+                if (validator->depth >= MAX_NESTING_DEPTH) {
+                    set_error(JE_TOO_DEEP, pos);
+                    goto failed;
+                }
+                validator->stack[validator->depth++] = kind == TK_BEGIN_ARRAY ? '[' : '{';
+                validator->state = kind == TK_BEGIN_ARRAY ? VS_FIRST_VALUE : VS_FIRST_KEY;
+            }
+            else if (kind <= TK_STR) { // false / true / null / number / string
+                validator->state = VS_AFTER_VALUE;
+            }
+            else {
+                goto unexpected;
+            }
+            return true;
+        case VS_FIRST_KEY:
+            if (kind == TK_END_OBJECT) {
+                validator->depth--;
+                validator->state = VS_AFTER_VALUE;
+                return true;
+            }
+            // fallthrough
+        case VS_KEY:
+            if (kind != TK_STR)
+                goto unexpected;
+            validator->state = VS_NAME_SEP;
+            return true;
+        case VS_NAME_SEP:
+            if (kind != TK_NAME_SEP)
+                goto unexpected;
+            validator->state = VS_VALUE;
+            return true;
+        case VS_AFTER_VALUE: {
+            char open = validator->stack[validator->depth - 1];
+            if (kind == TK_VALUE_SEP)
+                validator->state = open == '[' ? VS_VALUE : VS_KEY;
+            else if ((kind == TK_END_ARRAY && open == '[') || (kind == TK_END_OBJECT && open == '{'))
+                validator->depth--;
+            else
+                goto unexpected;
+            return true;
+        }
+    }
+
+unexpected:
+    set_error(JE_UNEXPECTED_TOKEN, pos);
+failed:
+    ERROR_FLAGS |= PARSE_ERROR;
+    return false;
+}
+
+// The input ends at pos.
+static bool validate_end(Validator *validator, const char *pos)
+{
+    if (validator->state != VS_AFTER_VALUE || validator->depth) {
+        set_error(JE_UNEXPECTED_EOF, pos);
+        ERROR_FLAGS |= PARSE_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool json_validate(const char *buf, size_t len)
+{
+    reset_error();
+
+    Validator validator;
+    initial_validator(&validator);
+    const char *current_char = buf;
+    const char *end_char = buf + len;
+
+    while ((current_char = skip_whitespace(current_char, end_char)) < end_char) {
+        // 余分なトークンは字句エラーより先に報告する
+        if (validator.state == VS_AFTER_VALUE && !validator.depth) {
+            set_error(JE_TRAILING_DATA, current_char);
+            ERROR_FLAGS |= PARSE_ERROR;
+            goto failed;
+        }
+        TokenKind kind;
+        const char *next_char = scan_token(current_char, end_char, &kind);
+        if (!next_char) {
+            ERROR_FLAGS |= TOKENIZE_ERROR;
+            goto failed;
+        }
+        if (!validate_token(&validator, kind, current_char))
+            goto failed;
+        current_char = next_char;
+    }
+    if (validate_end(&validator, end_char))
+        return true;
+
+failed:
+    locate_error(buf, end_char);
+    return false;
+}
+
+// Checks the grammar of an indexed document. The tokens themselves were
+// checked by build_index(), so only their first bytes are looked at.
+bool validate_indexed(const char *code, const StructuralIndex *index)
+{
+    reset_error();
+    if (!index_matches(code, index)) {
+        ERROR_FLAGS |= PARSE_ERROR;
+        set_error(JE_INDEX_MISMATCH, NULL);
+        locate_error(code, NULL);
+        return false;
+    }
+
+    Validator validator;
+    initial_validator(&validator);
+    for (uint32_t position = 0; index->size > position; position++) {
+        const char *pos = code + index->offsets[position];
+        if (!validate_token(&validator, kind_at(code, index->offsets[position]), pos)) {
+            locate_error(code, NULL);
+            return false;
+        }
+    }
+    if (validate_end(&validator, NULL))
+        return true;
+    locate_error(code, NULL);
+    return false;
+}
@@ -0,0 +1,443 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include "cjson.h"
+
+// Streaming writer.
+//
+// Output is generated directly from write_*() calls without building a
+// tree.  The writer keeps track of nesting and commas and rejects calls that
+// would produce invalid JSON.  Output goes into a fixed buffer of
+// WRITER_BUFFER_SIZE bytes which is handed to the write function whenever
+// it fills up, so memory use does not depend on the size of the output.
+//
+// Any failure (a misplaced call, a write function returning false, NaN or
+// Infinity) is sticky: the failing call and every later call return false.
+
+struct JSONWriter {
+    JSONWriteFunc write;
+    void *user_data;
+    int fd; // new_fd_writer()
+
+    bool failed;
+    bool comma;     // 次の値やキーの前に','が必要
+    bool after_key; // オブジェクトの中でキーを書いた直後
+    bool done;      // ルートの値を書き終えた
+    unsigned int depth;
+    char stack[MAX_NESTING_DEPTH];
+
+    size_t size;
+    char buffer[WRITER_BUFFER_SIZE];
+};
+
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static bool write_fd(void *user_data, const char *data, size_t size)
+{
+    int fd = *(int *)user_data;
+    while (size) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+JSONWriter *new_writer(JSONWriteFunc write, void *user_data)
+{
+    JSONWriter *writer = malloc(sizeof(JSONWriter));
+    if (!writer) {
+        ERROR_FLAGS |= MEMORY_ALLOCATION_ERROR;
+        return NULL;
+    }
+    writer->write = write;
+    writer->user_data = user_data;
+    writer->fd = -1;
+    writer->failed = false;
+    writer->comma = false;
+    writer->after_key = false;
+    writer->done = false;
+    writer->depth = 0;
+    writer->size = 0;
+    return writer;
+}
+
+// The fd is not closed by free_writer().
+JSONWriter *new_fd_writer(int fd)
+{
+    JSONWriter *writer = new_writer(write_fd, NULL);
+    if (!writer)
+        return NULL;
+    writer->fd = fd;
+    writer->user_data = &writer->fd;
+    return writer;
+}
+
+// Does not flush. Call finish_writer() or flush_writer() first.
+void free_writer(JSONWriter *writer)
+{
+    free(writer);
+}
+
+static bool fail(JSONWriter *writer)
+{
+    writer->failed = true;
+    ERROR_FLAGS |= WRITE_ERROR;
+    return false;
+}
+
+// Hands the buffered output to the write function.
+bool flush_writer(JSONWriter *writer)
+{
+    if (writer->failed)
+        return false;
+    if (writer->size && !writer->write(writer->user_data, writer->buffer, writer->size))
+        return fail(writer);
+    writer->size = 0;
+    return true;
+}
+
+// Makes room for size bytes in the buffer. size <= WRITER_BUFFER_SIZE
+static bool reserve(JSONWriter *writer, size_t size)
+{
+    return WRITER_BUFFER_SIZE - writer->size >= size || flush_writer(writer);
+}
+
+static bool put_bytes(JSONWriter *writer, const char *data, size_t size)
+{
+    while (size) {
+        if (writer->size == WRITER_BUFFER_SIZE && !flush_writer(writer))
+            return false;
+        size_t n = WRITER_BUFFER_SIZE - writer->size;
+        if (n > size)
+            n = size;
+        memcpy(writer->buffer + writer->size, data, n);
+        writer->size += n;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Checks that a value may be written here and writes the ',' before it.
+static bool begin_value(JSONWriter *writer)
+{
+    if (writer->failed)
+        return false;
+    if (!writer->depth) {
+        if (writer->done)
+            return fail(writer);
+        return true;
+    }
+    if (writer->stack[writer->depth - 1] == '{') {
+        if (!writer->after_key)
+            return fail(writer);
+        writer->after_key = false;
+        return true;
+    }
+    if (writer->comma) {
+        if (!reserve(writer, 1))
+            return false;
+        writer->buffer[writer->size++] = ',';
+    }
+    return true;
+}
+
+static void end_value(JSONWriter *writer)
+{
+    if (writer->depth)
+        writer->comma = true;
+    else
+        writer->done = true;
+}
+
+static bool begin_container(JSONWriter *writer, char c)
+{
+    if (!begin_value(writer))
+        return false;
+    if (writer->depth >= MAX_NESTING_DEPTH)
+        return fail(writer);
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->size++] = c;
+    writer->stack[writer->depth++] = c;
+    writer->comma = false;
+    return true;
+}
+
+static bool end_container(JSONWriter *writer, char begin, char end)
+{
+    if (writer->failed)
+        return false;
+    if (!writer->depth || writer->stack[writer->depth - 1] != begin || writer->after_key)
+        return fail(writer);
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->size++] = end;
+    writer->depth--;
+    end_value(writer);
+    return true;
+}
+
+bool write_begin_object(JSONWriter *writer)
+{
+    return begin_container(writer, '{');
+}
+
+bool write_end_object(JSONWriter *writer)
+{
+    return end_container(writer, '{', '}');
+}
+
+bool write_begin_array(JSONWriter *writer)
+{
+    return begin_container(writer, '[');
+}
+
+bool write_end_array(JSONWriter *writer)
+{
+    return end_container(writer, '[', ']');
+}
+
+// True if one of the 8 bytes of word is '"', '\\', a control character or
+// 0xC0, the first byte of U+0000 in the parser's strings.
+static bool needs_escape(uint64_t word)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t quote = word ^ (ones * '"');
+    uint64_t backslash = word ^ (ones * '\\');
+    uint64_t nul = word ^ (ones * 0xC0);
+    uint64_t found = (word - ones * 0x20) & ~word;
+    found |= (quote - ones) & ~quote;
+    found |= (backslash - ones) & ~backslash;
+    found |= (nul - ones) & ~nul;
+    return found & highs;
+}
+
+// Writes str quoted. UTF-8 is copied as is.
+static bool put_string(JSONWriter *writer, const char *str, size_t length)
+{
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->size++] = '"';
+
+    const char *end_char = str + length;
+    while (str < end_char) {
+        // エスケープの要らない部分は8バイトずつ調べてまとめてコピーする
+        const char *run = str;
+        while (true) {
+            while (end_char - str >= 8) {
+                uint64_t word;
+                memcpy(&word, str, 8);
+                if (needs_escape(word))
+                    break;
+                str += 8;
+            }
+            // 見つかった8バイトか末尾だけ1バイトずつ調べる
+            const char *limit = end_char - str >= 8 ? str + 8 : end_char;
+            while (str < limit) {
+                unsigned char c = *str;
+                if (c < 0x20 || c == '"' || c == '\\')
+                    break;
+                if (c == 0xC0 && end_char - str >= 2 && (unsigned char)str[1] == 0x80)
+                    break;
+                str++;
+            }
+            if (str < limit || str == end_char)
+                break;
+        }
+        if (!put_bytes(writer, run, str - run))
+            return false;
+        if (str == end_char)
+            break;
+
+        unsigned char c = *str++;
+        if (c == 0xC0) { // C0 80
+            c = 0;
+            str++;
+        }
+        if (!reserve(writer, 6))
+            return false;
+        char *p = writer->buffer + writer->size;
+        p[0] = '\\';
+        switch (c) {
+            case '"':  p[1] = '"'; break;
+            case '\\': p[1] = '\\'; break;
+            case 0x08: p[1] = 'b'; break;
+            case 0x09: p[1] = 't'; break;
+            case 0x0A: p[1] = 'n'; break;
+            case 0x0C: p[1] = 'f'; break;
+            case 0x0D: p[1] = 'r'; break;
+            default:
+                p[1] = 'u';
+                p[2] = '0';
+                p[3] = '0';
+                p[4] = HEX_DIGITS[c >> 4];
+                p[5] = HEX_DIGITS[c & 0xf];
+                writer->size += 4;
+                break;
+        }
+        writer->size += 2;
+    }
+
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->size++] = '"';
+    return true;
+}
+
+bool write_key_length(JSONWriter *writer, const char *key, size_t length)
+{
+    if (writer->failed)
+        return false;
+    if (!writer->depth || writer->stack[writer->depth - 1] != '{' || writer->after_key)
+        return fail(writer);
+    if (writer->comma) {
+        if (!reserve(writer, 1))
+            return false;
+        writer->buffer[writer->size++] = ',';
+    }
+    if (!put_string(writer, key, length) || !reserve(writer, 1))
+        return false;
+    writer->buffer[writer->size++] = ':';
+    writer->after_key = true;
+    return true;
+}
+
+bool write_key(JSONWriter *writer, const char *key)
+{
+    return write_key_length(writer, key, strlen(key));
+}
+
+bool write_string_length(JSONWriter *writer, const char *str, size_t length)
+{
+    if (!begin_value(writer) || !put_string(writer, str, length))
+        return false;
+    end_value(writer);
+    return true;
+}
+
+bool write_string(JSONWriter *writer, const char *str)
+{
+    return write_string_length(writer, str, strlen(str));
+}
+
+// Writes the digits of num at the end of buf and returns the first one.
+static char *format_uint(char *end, unsigned long long num)
+{
+    char *p = end;
+    while (num >= 100) {
+        unsigned int pair = num % 100 * 2;
+        num /= 100;
+        *--p = DIGIT_PAIRS[pair + 1];
+        *--p = DIGIT_PAIRS[pair];
+    }
+    if (num >= 10) {
+        *--p = DIGIT_PAIRS[num * 2 + 1];
+        *--p = DIGIT_PAIRS[num * 2];
+    }
+    else {
+        *--p = '0' + num;
+    }
+    return p;
+}
+
+bool write_int(JSONWriter *writer, long long num)
+{
+    if (!begin_value(writer) || !reserve(writer, 20))
+        return false;
+    char buf[20];
+    char *end = buf + sizeof(buf);
+    char *p = format_uint(end, num < 0 ? 0ULL - (unsigned long long)num : (unsigned long long)num);
+    if (num < 0)
+        *--p = '-';
+    memcpy(writer->buffer + writer->size, p, end - p);
+    writer->size += end - p;
+    end_value(writer);
+    return true;
+}
+
+bool write_double(JSONWriter *writer, double num)
+{
+    if (writer->failed)
+        return false;
+    if (isnan(num) || isinf(num)) {
+        ERROR_FLAGS |= UNSUPPORTED_ERROR;
+        return fail(writer);
+    }
+    if (!begin_value(writer) || !reserve(writer, DTOA_BUFFER_SIZE))
+        return false;
+    writer->size += format_double(writer->buffer + writer->size, num);
+    end_value(writer);
+    return true;
+}
+
+bool write_bool(JSONWriter *writer, bool value)
+{
+    if (!begin_value(writer))
+        return false;
+    if (!put_bytes(writer, value ? "true" : "false", value ? 4 : 5))
+        return false;
+    end_value(writer);
+    return true;
+}
+
+bool write_null(JSONWriter *writer)
+{
+    if (!begin_value(writer) || !put_bytes(writer, "null", 4))
+        return false;
+    end_value(writer);
+    return true;
+}
+
+// Writes a whole tree, e.g. to embed a parsed document in the output.
+bool write_value(JSONWriter *writer, const JSONValue *value)
+{
+    switch (value->type) {
+        case JV_BOOL:
+            return write_bool(writer, value->value);
+        case JV_NULL:
+            return write_null(writer);
+        case JV_NUM:
+            return write_double(writer, (double)value->num);
+        case JV_STR:
+            return write_string(writer, value->str);
+        case JV_ARRAY:
+            if (!write_begin_array(writer))
+                return false;
+            for (const JSONValue *current = value->elements; current; current = current->next)
+                if (!write_value(writer, current))
+                    return false;
+            return write_end_array(writer);
+        case JV_OBJECT:
+            if (!write_begin_object(writer))
+                return false;
+            for (const JSONMember *current = value->members; current; current = current->next)
+                if (!write_key(writer, current->key) || !write_value(writer, current->value))
+                    return false;
+            return write_end_object(writer);
+    }
+    return false;
+}
+
+// Checks that exactly one complete value was written and flushes it.
+bool finish_writer(JSONWriter *writer)
+{
+    if (writer->failed)
+        return false;
+    if (!writer->done)
+        return fail(writer);
+    return flush_writer(writer);
+}